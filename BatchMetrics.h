@@ -0,0 +1,315 @@
+#ifndef BATCH_METRICS_H
+#define BATCH_METRICS_H
+
+// Progress counters of rcs-batch, exported as a Prometheus text file and a
+// one line progress display.
+//
+// Each worker thread leases a slot and only updates its own counters, with
+// relaxed atomics, so reporting adds no contention between workers. Slots
+// are padded to separate cache lines. The reporter sums the slots when it
+// takes a sample, which makes the totals slightly stale but never
+// blocks a worker. A thread finding no free slot adds one, so two threads
+// never share a slot.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Format.h"
+#include "llvm/Support/raw_ostream.h"
+
+class BatchMetrics {
+      public:
+	using Clock = std::chrono::steady_clock;
+
+      private:
+	struct Slot {
+		std::atomic<uint64_t> done{0};
+		std::atomic<uint64_t> failed{0};
+		std::atomic<uint64_t> bytes{0};
+		std::atomic<uint64_t> cacheHits{0};
+		// Clock ticks when the current TU started, 0 when idle
+		std::atomic<int64_t> started{0};
+		// only contended by the reporter, once per sample
+		std::mutex fileLock;
+		std::string file;
+		// keep neighbouring slots out of the same cache line
+		char padding[64];
+	};
+
+	// grows under leaseLock, a deque so that leased slots never move
+	std::deque<Slot> slots;
+	std::mutex leaseLock;
+	std::vector<unsigned> freeSlots;
+	Clock::time_point startTime = Clock::now();
+
+	std::atomic<uint64_t> expected{0};
+	std::atomic<bool> expectedExact{true};
+
+	unsigned lease(Slot *&slot) {
+		std::lock_guard<std::mutex> guard(leaseLock);
+		if (freeSlots.empty()) {
+			slots.emplace_back();
+			slot = &slots.back();
+			return slots.size() - 1;
+		}
+		unsigned index = freeSlots.back();
+		freeSlots.pop_back();
+		slot = &slots[index];
+		return index;
+	}
+
+	void release(unsigned slot) {
+		std::lock_guard<std::mutex> guard(leaseLock);
+		if (std::find(freeSlots.begin(), freeSlots.end(), slot) ==
+		    freeSlots.end())
+			freeSlots.push_back(slot);
+	}
+
+	// The calling thread's slot, given back when the thread exits.
+	// Counters stay in the slot, they are totals over all its owners.
+	Slot &slot() {
+		struct Lease {
+			BatchMetrics *owner = nullptr;
+			unsigned index = 0;
+			Slot *slot = nullptr;
+			~Lease() {
+				if (owner)
+					owner->release(index);
+			}
+		};
+		thread_local Lease lease;
+		if (lease.owner != this) {
+			if (lease.owner)
+				lease.owner->release(lease.index);
+			lease.owner = this;
+			lease.index = this->lease(lease.slot);
+		}
+		return *lease.slot;
+	}
+
+      public:
+	explicit BatchMetrics(unsigned workers) : slots(std::max(workers, 1u)) {
+		for (unsigned i = slots.size(); i > 0; i--)
+			freeSlots.push_back(i - 1);
+	}
+
+	// Called by a worker around each translation unit.
+	void beginTU(llvm::StringRef file) {
+		auto &current = slot();
+		{
+			std::lock_guard<std::mutex> guard(current.fileLock);
+			current.file = file.str();
+		}
+		current.started.store(Clock::now().time_since_epoch().count(),
+		                      std::memory_order_relaxed);
+	}
+
+	void endTU(uint64_t bytes, uint64_t cacheHits, bool ok) {
+		auto &current = slot();
+		current.started.store(0, std::memory_order_relaxed);
+		current.bytes.fetch_add(bytes, std::memory_order_relaxed);
+		current.cacheHits.fetch_add(cacheHits, std::memory_order_relaxed);
+		(ok ? current.done : current.failed)
+		    .fetch_add(1, std::memory_order_relaxed);
+	}
+
+	// Number of TUs the run will analyze; `exact` is false while it is
+	// still an estimate, e.g. for a database that is being streamed.
+	void setExpected(uint64_t count, bool exact) {
+		expected.store(count, std::memory_order_relaxed);
+		expectedExact.store(exact, std::memory_order_relaxed);
+	}
+
+	void addExpected(uint64_t count) {
+		expected.fetch_add(count, std::memory_order_relaxed);
+	}
+
+	struct WorkerSample {
+		uint64_t done, failed, bytes, cacheHits;
+		// seconds spent on the current TU, negative when idle
+		double inFlight;
+		std::string file;
+	};
+
+	struct Sample {
+		double elapsed;
+		uint64_t done = 0, failed = 0, bytes = 0, cacheHits = 0;
+		// TUs not started yet
+		uint64_t expected, queueDepth = 0;
+		bool expectedExact;
+		std::vector<WorkerSample> workers;
+		// worker on the slowest TU still being analyzed, -1 if none
+		int slowest = -1;
+
+		uint64_t finished() const { return done + failed; }
+
+		double rate() const {
+			return elapsed > 0 ? finished() / elapsed : 0;
+		}
+
+		// seconds left at the current rate, negative if unknown
+		double eta() const {
+			if (!rate() || expected < finished())
+				return -1;
+			return (expected - finished()) / rate();
+		}
+	};
+
+	Sample sample() {
+		Sample result;
+		auto now = Clock::now();
+		result.elapsed =
+		    std::chrono::duration<double>(now - startTime).count();
+		result.expected = expected.load(std::memory_order_relaxed);
+		result.expectedExact =
+		    expectedExact.load(std::memory_order_relaxed);
+		// only keeps new threads from adding a slot meanwhile
+		std::unique_lock<std::mutex> leases(leaseLock);
+		for (auto &slot : slots) {
+			WorkerSample worker;
+			worker.done = slot.done.load(std::memory_order_relaxed);
+			worker.failed = slot.failed.load(std::memory_order_relaxed);
+			worker.bytes = slot.bytes.load(std::memory_order_relaxed);
+			worker.cacheHits =
+			    slot.cacheHits.load(std::memory_order_relaxed);
+			auto started = slot.started.load(std::memory_order_relaxed);
+			worker.inFlight = -1;
+			if (started) {
+				Clock::time_point begin{Clock::duration(started)};
+				worker.inFlight =
+				    std::chrono::duration<double>(now - begin)
+				        .count();
+				std::lock_guard<std::mutex> guard(slot.fileLock);
+				worker.file = slot.file;
+			}
+			result.done += worker.done;
+			result.failed += worker.failed;
+			result.bytes += worker.bytes;
+			result.cacheHits += worker.cacheHits;
+			result.workers.push_back(std::move(worker));
+		}
+		leases.unlock();
+		uint64_t busy = 0;
+		for (unsigned i = 0; i < result.workers.size(); i++) {
+			busy += result.workers[i].inFlight >= 0;
+			if (result.workers[i].inFlight >= 0 &&
+			    (result.slowest < 0 ||
+			     result.workers[i].inFlight >
+			         result.workers[result.slowest].inFlight))
+				result.slowest = i;
+		}
+		if (result.expected > result.finished() + busy)
+			result.queueDepth = result.expected - result.finished() - busy;
+		return result;
+	}
+};
+
+// Writes `sample` in the Prometheus text exposition format.
+inline void writePrometheus(llvm::raw_ostream &os,
+                            const BatchMetrics::Sample &sample) {
+	auto metric = [&](llvm::StringRef name, llvm::StringRef type,
+	                  llvm::StringRef help) {
+		os << "# HELP " << name << " " << help << "\n";
+		os << "# TYPE " << name << " " << type << "\n";
+	};
+	auto perWorker = [&](llvm::StringRef name, llvm::StringRef help,
+	                     uint64_t BatchMetrics::WorkerSample::*field) {
+		metric(name, "counter", help);
+		for (size_t i = 0; i < sample.workers.size(); i++) {
+			os << name << "{worker=\"" << i << "\"} "
+			   << sample.workers[i].*field << "\n";
+		}
+	};
+	perWorker("rcs_translation_units_total",
+	          "Translation units analyzed.",
+	          &BatchMetrics::WorkerSample::done);
+	perWorker("rcs_failed_translation_units_total",
+	          "Translation units that failed to parse.",
+	          &BatchMetrics::WorkerSample::failed);
+	perWorker("rcs_parsed_bytes_total",
+	          "Bytes of source and headers read by the parser.",
+	          &BatchMetrics::WorkerSample::bytes);
+	perWorker("rcs_header_cache_hits_total",
+	          "Headers whose analysis was reused from the header cache.",
+	          &BatchMetrics::WorkerSample::cacheHits);
+
+	metric("rcs_worker_translation_units_per_second", "gauge",
+	       "Average analysis rate of each worker.");
+	for (size_t i = 0; i < sample.workers.size(); i++) {
+		auto &worker = sample.workers[i];
+		os << "rcs_worker_translation_units_per_second{worker=\"" << i
+		   << "\"} "
+		   << llvm::format("%.3f", sample.elapsed > 0
+		                               ? (worker.done + worker.failed) /
+		                                     sample.elapsed
+		                               : 0.0)
+		   << "\n";
+	}
+	metric("rcs_expected_translation_units", "gauge",
+	       "Translation units the run will analyze, estimated while the "
+	       "database is read.");
+	os << "rcs_expected_translation_units " << sample.expected << "\n";
+	metric("rcs_queue_depth", "gauge",
+	       "Translation units waiting for a worker.");
+	os << "rcs_queue_depth " << sample.queueDepth << "\n";
+	metric("rcs_slowest_in_flight_seconds", "gauge",
+	       "Time spent so far on the slowest translation unit in flight.");
+	if (sample.slowest >= 0) {
+		auto &slowest = sample.workers[sample.slowest];
+		std::string file;
+		for (char c : slowest.file) {
+			if (c == '\\' || c == '"')
+				file += '\\';
+			file += c == '\n' ? 'n' : c;
+		}
+		os << "rcs_slowest_in_flight_seconds{file=\"" << file << "\"} "
+		   << llvm::format("%.1f", slowest.inFlight) << "\n";
+	} else {
+		os << "rcs_slowest_in_flight_seconds 0\n";
+	}
+}
+
+// e.g. [ 1200/~5000  24%] 31.5 TU/s, ETA 2m01s, slowest: big.cc (40s)
+inline std::string progressLine(const BatchMetrics::Sample &sample) {
+	std::string line;
+	llvm::raw_string_ostream os(line);
+	os << "[" << llvm::format_decimal(sample.finished(), 6) << "/"
+	   << (sample.expectedExact ? "" : "~") << sample.expected;
+	if (sample.expected) {
+		os << llvm::format(" %3.0f%%",
+		                   100.0 * std::min(sample.finished(),
+		                                    sample.expected) /
+		                       sample.expected);
+	}
+	os << "] " << llvm::format("%.1f", sample.rate()) << " TU/s";
+	auto eta = sample.eta();
+	if (eta >= 0) {
+		unsigned seconds = eta + 0.5;
+		os << ", ETA ";
+		if (seconds >= 3600)
+			os << seconds / 3600 << "h"
+			   << llvm::format("%02u", seconds / 60 % 60) << "m";
+		else
+			os << seconds / 60 << "m"
+			   << llvm::format("%02u", seconds % 60) << "s";
+	}
+	if (sample.failed)
+		os << ", " << sample.failed << " failed";
+	if (sample.slowest >= 0) {
+		auto &slowest = sample.workers[sample.slowest];
+		llvm::StringRef file = slowest.file;
+		os << ", slowest: " << file.substr(file.rfind('/') + 1) << " ("
+		   << llvm::format("%.0f", slowest.inFlight) << "s)";
+	}
+	return os.str();
+}
+
+#endif
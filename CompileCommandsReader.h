@@ -0,0 +1,303 @@
+#ifndef COMPILE_COMMANDS_READER_H
+#define COMPILE_COMMANDS_READER_H
+
+// Streaming reader for compile_commands.json, for databases too large to
+// parse up front. The file is memory mapped (MemoryBuffer maps large files)
+// and entries are decoded one at a time as the scheduler asks for them, so
+// the first TU can start right away and memory use doesn't grow with the
+// size of the database.
+//
+// Strings are located with memchr, which the C library vectorizes. Only
+// strings that contain escapes go through the slow unescaping path.
+//
+// Only the subset of JSON used by compilation databases is understood: an
+// array of objects whose values are strings or arrays of strings. Values
+// of other types are skipped.
+
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/ConvertUTF.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+struct CompileCommandEntry {
+	std::string directory;
+	std::string file;
+	std::string output;
+	// either `arguments`, or `command` as one shell escaped string
+	std::vector<std::string> arguments;
+	std::string command;
+};
+
+class CompileCommandsReader {
+      private:
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	const char *pos = nullptr;
+	const char *end = nullptr;
+	// entries after the first need a ',' before them
+	bool first = true;
+	std::string error;
+
+	bool fail(const char *message) {
+		if (error.empty()) {
+			error = std::string(message) + " at offset " +
+			        std::to_string(pos - buffer->getBufferStart());
+		}
+		pos = end;
+		return false;
+	}
+
+	void skipSpace() {
+		while (pos < end && (*pos == ' ' || *pos == '\n' ||
+		                     *pos == '\r' || *pos == '\t'))
+			pos++;
+	}
+
+	bool consume(char c) {
+		skipSpace();
+		if (pos < end && *pos == c) {
+			pos++;
+			return true;
+		}
+		return false;
+	}
+
+	static int hexValue(char c) {
+		if (c >= '0' && c <= '9')
+			return c - '0';
+		if (c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		if (c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		return -1;
+	}
+
+	bool readHex4(unsigned &value) {
+		if (end - pos < 4)
+			return false;
+		value = 0;
+		for (int i = 0; i < 4; i++) {
+			int digit = hexValue(pos[i]);
+			if (digit < 0)
+				return false;
+			value = value * 16 + digit;
+		}
+		pos += 4;
+		return true;
+	}
+
+	static void appendUTF8(std::string &out, unsigned code) {
+		char utf8[UNI_MAX_UTF8_BYTES_PER_CODE_POINT];
+		char *cursor = utf8;
+		llvm::ConvertCodePointToUTF8(code, cursor);
+		out.append(utf8, cursor);
+	}
+
+	// After a \u, decodes the code point and appends it. Unpaired
+	// surrogates become U+FFFD, as llvm::json::parse makes them.
+	bool readUnicode(std::string &out) {
+		unsigned code;
+		if (!readHex4(code))
+			return fail("bad \\u escape");
+		while (true) {
+			if (code < 0xD800 || code >= 0xE000) {
+				appendUTF8(out, code);
+				return true;
+			}
+			// a trailing surrogate, or a leading one alone
+			if (code >= 0xDC00 || end - pos < 2 || pos[0] != '\\' ||
+			    pos[1] != 'u') {
+				appendUTF8(out, 0xFFFD);
+				return true;
+			}
+			pos += 2;
+			unsigned low;
+			if (!readHex4(low))
+				return fail("bad \\u escape");
+			if (low >= 0xDC00 && low < 0xE000) {
+				code = 0x10000 + ((code - 0xD800) << 10) +
+				       (low - 0xDC00);
+				appendUTF8(out, code);
+				return true;
+			}
+			// the second escape is decoded on its own
+			appendUTF8(out, 0xFFFD);
+			code = low;
+		}
+	}
+
+	// pos is after the opening quote
+	bool readString(std::string &out) {
+		out.clear();
+		while (true) {
+			auto quote = static_cast<const char *>(
+			    memchr(pos, '"', end - pos));
+			if (!quote)
+				return fail("unterminated string");
+			auto escape = static_cast<const char *>(
+			    memchr(pos, '\\', quote - pos));
+			if (!escape) {
+				out.append(pos, quote);
+				pos = quote + 1;
+				return true;
+			}
+			out.append(pos, escape);
+			pos = escape + 1;
+			if (pos >= end)
+				return fail("unterminated string");
+			char c = *pos++;
+			switch (c) {
+			case '"':
+			case '\\':
+			case '/':
+				out += c;
+				break;
+			case 'b':
+				out += '\b';
+				break;
+			case 'f':
+				out += '\f';
+				break;
+			case 'n':
+				out += '\n';
+				break;
+			case 'r':
+				out += '\r';
+				break;
+			case 't':
+				out += '\t';
+				break;
+			case 'u':
+				if (!readUnicode(out))
+					return false;
+				break;
+			default:
+				return fail("bad escape");
+			}
+		}
+	}
+
+	// skips a value of a type compilation databases don't use
+	bool skipValue() {
+		skipSpace();
+		if (pos >= end)
+			return fail("unexpected end of file");
+		if (*pos == '"') {
+			pos++;
+			std::string ignored;
+			return readString(ignored);
+		}
+		if (*pos == '[' || *pos == '{') {
+			char open = *pos, close = open == '[' ? ']' : '}';
+			pos++;
+			if (consume(close))
+				return true;
+			do {
+				if (open == '{') {
+					std::string key;
+					if (!consume('"') || !readString(key) ||
+					    !consume(':'))
+						return fail("expected key");
+				}
+				if (!skipValue())
+					return false;
+			} while (consume(','));
+			return consume(close) || fail("expected end of value");
+		}
+		// number, true, false, null
+		while (pos < end && *pos != ',' && *pos != '}' && *pos != ']')
+			pos++;
+		return true;
+	}
+
+	bool readStringArray(std::vector<std::string> &out) {
+		out.clear();
+		if (consume(']'))
+			return true;
+		do {
+			out.emplace_back();
+			if (!consume('"') || !readString(out.back()))
+				return fail("expected string in array");
+		} while (consume(','));
+		return consume(']') || fail("expected ']'");
+	}
+
+      public:
+	// Maps `path`, returns false and sets the error if it can't be read.
+	bool open(llvm::StringRef path) {
+		auto file = llvm::MemoryBuffer::getFile(path, -1, false);
+		if (!file) {
+			error = "cannot read " + path.str() + ": " +
+			        file.getError().message();
+			return false;
+		}
+		buffer = std::move(*file);
+		pos = buffer->getBufferStart();
+		end = buffer->getBufferEnd();
+		if (!consume('['))
+			return fail("expected '['");
+		return true;
+	}
+
+	// Decodes the next entry. Returns false at the end of the database or
+	// on a syntax error, check getError() to tell them apart.
+	bool next(CompileCommandEntry &entry) {
+		if (pos >= end)
+			return false;
+		if (consume(']')) {
+			pos = end;
+			return false;
+		}
+		// separator from the previous entry
+		if (!first && !consume(','))
+			return fail("expected ','");
+		first = false;
+		if (!consume('{'))
+			return fail("expected '{'");
+		entry = CompileCommandEntry();
+		if (consume('}'))
+			return true;
+		std::string key;
+		do {
+			if (!consume('"') || !readString(key) || !consume(':'))
+				return fail("expected key");
+			skipSpace();
+			bool isString = pos < end && *pos == '"';
+			if (key == "arguments" && consume('[')) {
+				if (!readStringArray(entry.arguments))
+					return false;
+			} else if (isString && (key == "directory" ||
+			                        key == "file" ||
+			                        key == "output" ||
+			                        key == "command")) {
+				pos++;
+				auto &value = key == "directory" ? entry.directory
+				              : key == "file"    ? entry.file
+				              : key == "output"  ? entry.output
+				                                 : entry.command;
+				if (!readString(value))
+					return false;
+			} else if (!skipValue()) {
+				return false;
+			}
+		} while (consume(','));
+		if (!consume('}'))
+			return fail("expected '}'");
+		return true;
+	}
+
+	// Fraction of the file decoded so far.
+	double progress() const {
+		if (!buffer || !buffer->getBufferSize())
+			return 1;
+		return double(pos - buffer->getBufferStart()) /
+		       buffer->getBufferSize();
+	}
+
+	const std::string &getError() const { return error; }
+};
+
+#endif
@@ -0,0 +1,153 @@
+#ifndef EVENT_TRACE_H
+#define EVENT_TRACE_H
+
+// Traces of what the traversal feeds the scope engine, written with
+// -record-events and replayed by rcs-replay. A trace lets the engine be
+// benchmarked on a real TU without parsing it again.
+//
+// Layout:
+//
+//   "RCSE0001"
+//   events, each a kind byte followed by ULEB128 fields:
+//     1 global       decl, name size, name bytes
+//     2 reference    decl, scope
+//     3 scope enter  scope, parent, loop depth
+//     4 scope exit   scope, parent
+//
+// Decls and blocks are numbered from 1 in the order they first appear,
+// 0 is no block (the parent of an outermost one). Only the globals and
+// references the engine tracks are recorded, after the header and
+// import filters.
+
+#include <cstdint>
+#include <string>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/LEB128.h"
+#include "llvm/Support/raw_ostream.h"
+
+static const char eventTraceMagic[] = "RCSE0001";
+
+enum class TraceEvent : uint8_t {
+	Global = 1,
+	Reference = 2,
+	ScopeEnter = 3,
+	ScopeExit = 4,
+};
+
+class TraceWriter {
+      private:
+	std::string buffer;
+	llvm::raw_string_ostream os{buffer};
+	llvm::DenseMap<const void *, uint32_t> declIds, scopeIds;
+
+	static uint32_t id(llvm::DenseMap<const void *, uint32_t> &ids,
+	                   const void *node) {
+		if (node == nullptr)
+			return 0;
+		auto result = ids.try_emplace(node, ids.size() + 1);
+		return result.first->second;
+	}
+
+	void event(TraceEvent kind, uint64_t a, uint64_t b) {
+		os << char(kind);
+		llvm::encodeULEB128(a, os);
+		llvm::encodeULEB128(b, os);
+	}
+
+      public:
+	TraceWriter() { os << eventTraceMagic; }
+
+	void global(const void *decl, llvm::StringRef name) {
+		event(TraceEvent::Global, id(declIds, decl), name.size());
+		os << name;
+	}
+
+	void reference(const void *decl, const void *scope) {
+		event(TraceEvent::Reference, id(declIds, decl),
+		      id(scopeIds, scope));
+	}
+
+	void scopeEnter(const void *scope, const void *parent,
+	                unsigned loopDepth) {
+		event(TraceEvent::ScopeEnter, id(scopeIds, scope),
+		      id(scopeIds, parent));
+		llvm::encodeULEB128(loopDepth, os);
+	}
+
+	void scopeExit(const void *scope, const void *parent) {
+		event(TraceEvent::ScopeExit, id(scopeIds, scope),
+		      id(scopeIds, parent));
+	}
+
+	const std::string &data() { return os.str(); }
+};
+
+// Receives the events of a trace, e.g. a scope engine under benchmark.
+class TraceConsumer {
+      public:
+	virtual ~TraceConsumer() = default;
+	virtual void onGlobal(uint32_t decl, llvm::StringRef name) = 0;
+	virtual void onReference(uint32_t decl, uint32_t scope) = 0;
+	virtual void onScopeEnter(uint32_t scope, uint32_t parent,
+	                          unsigned loopDepth) = 0;
+	virtual void onScopeExit(uint32_t scope, uint32_t parent) = 0;
+};
+
+// Feeds the events of `trace` to `consumer`. Returns false and sets
+// `error` if the trace is malformed, after the events before the error.
+inline bool replayTrace(llvm::StringRef trace, TraceConsumer &consumer,
+                        std::string &error) {
+	if (!trace.startswith(eventTraceMagic)) {
+		error = "not an event trace";
+		return false;
+	}
+	auto pos = trace.bytes_begin() + sizeof(eventTraceMagic) - 1;
+	auto end = trace.bytes_end();
+	const char *leb128Error = nullptr;
+	auto next = [&]() -> uint64_t {
+		unsigned size;
+		auto value = llvm::decodeULEB128(pos, &size, end, &leb128Error);
+		pos += size;
+		return value;
+	};
+	while (pos < end) {
+		auto kind = TraceEvent(*pos++);
+		auto a = next(), b = next();
+		switch (kind) {
+		case TraceEvent::Global:
+			if (leb128Error || b > uint64_t(end - pos))
+				break;
+			consumer.onGlobal(
+			    a, llvm::StringRef((const char *)pos, b));
+			pos += b;
+			continue;
+		case TraceEvent::Reference:
+			if (leb128Error)
+				break;
+			consumer.onReference(a, b);
+			continue;
+		case TraceEvent::ScopeEnter: {
+			auto loopDepth = next();
+			if (leb128Error)
+				break;
+			consumer.onScopeEnter(a, b, loopDepth);
+			continue;
+		}
+		case TraceEvent::ScopeExit:
+			if (leb128Error)
+				break;
+			consumer.onScopeExit(a, b);
+			continue;
+		default:
+			error = "unknown event";
+			return false;
+		}
+		error = leb128Error ? leb128Error : "truncated name";
+		return false;
+	}
+	return true;
+}
+
+#endif
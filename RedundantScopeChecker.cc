@@ -1,24 +1,51 @@
 #include <algorithm>
+#include <chrono>
 #include <cstdio>
+#include <memory>
+#include <mutex>
 #include <unordered_map>
 #include <vector>
 
+#include "EventTrace.h"
+#include "RedundantScopeChecker.h"
+#include "ScopeTable.h"
 #include "clang/AST/AST.h"
 #include "clang/AST/ASTConsumer.h"
+#include "clang/AST/Mangle.h"
+#include "clang/AST/ParentMapContext.h"
+#include "clang/AST/RecordLayout.h"
 #include "clang/AST/RecursiveASTVisitor.h"
+#include "clang/Analysis/Analyses/ExprMutationAnalyzer.h"
 #include "clang/Basic/FileManager.h"
 #include "clang/Frontend/CompilerInstance.h"
 #include "clang/Frontend/FrontendPluginRegistry.h"
+#include "clang/Lex/Lexer.h"
+#include "clang/Lex/MacroInfo.h"
+#include "clang/Lex/PPCallbacks.h"
+#include "clang/Lex/Preprocessor.h"
 #include "clang/Sema/Sema.h"
 #include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/DenseSet.h"
+#include "llvm/ADT/STLExtras.h"
+#include "llvm/ADT/SmallPtrSet.h"
+#include "llvm/ADT/SmallVector.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/ADT/StringSwitch.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/GlobPattern.h"
+#include "llvm/Support/MathExtras.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/xxhash.h"
 #include "llvm/Support/raw_ostream.h"
 using namespace clang;
 
-struct UsageInformation {
-	Stmt *usedIn;
-	CompoundStmt *parent;
-	std::vector<UsageInformation> children;
-};
+using UsageInformation = ScopeUsage<Stmt, CompoundStmt>;
 
 struct {
 	bool dumpAst = false;
@@ -26,6 +53,23 @@ struct {
 	bool warnInit = false;
 	bool noShowUsages = false;
 	bool verbose = false;
+	bool onParse = false;
+	bool hoistLocals = false;
+	bool relocations = false;
+	bool constexprTables = false;
+	bool frozenContainers = false;
+	bool soa = false;
+	bool padding = false;
+	bool volatileLoops = false;
+	std::vector<std::string> includePaths;
+	std::vector<std::string> excludePaths;
+	std::vector<std::string> changedLines;
+	std::vector<std::string> jobs;
+	std::vector<std::string> sampleRate;
+	std::vector<std::string> buildId;
+	std::vector<std::string> sampleLog;
+	std::vector<std::string> largeCopies;
+	std::vector<std::string> recordEvents;
 } options;
 
 // For debugging
@@ -46,6 +90,9 @@ void fatal(const std::string &message) {
 struct PluginOption {
 	bool *addr;
 	std::string help;
+	// set for options of the form -name=value, which may be repeated
+	std::vector<std::string> *values = nullptr;
+	const char *metavar = "<glob>";
 };
 
 std::map<std::string, PluginOption> validOptions = {
@@ -59,12 +106,90 @@ std::map<std::string, PluginOption> validOptions = {
      {&options.noShowUsages, "Do not show detailed "
                              "usage information for variables."}},
     {"-verbose", {&options.verbose, "(For debugging) Print verbose logs."}},
+    {"-on-parse",
+     {&options.onParse, "Analyze each top level declaration as soon as "
+                        "it is parsed instead of walking the whole "
+                        "translation unit at the end."}},
+    {"-hoist-locals",
+     {&options.hoistLocals, "Also warn about locals built from constants "
+                            "on every call, which could be 'static "
+                            "const' or 'constexpr'."}},
+    {"-relocations",
+     {&options.relocations, "Report globals whose initializer needs "
+                            "dynamic relocations in position "
+                            "independent code."}},
+    {"-constexpr-tables",
+     {&options.constexprTables, "Report global arrays filled at startup "
+                                "by a loop that could run at compile "
+                                "time."}},
+    {"-frozen-containers",
+     {&options.frozenContainers, "Report global std maps and sets that "
+                                 "are only read after they are filled."}},
+    {"-soa",
+     {&options.soa, "Report global arrays of structs whose loops only use "
+                    "a few fields of each element."}},
+    {"-padding",
+     {&options.padding, "Report global structs and arrays of structs "
+                        "whose fields could be reordered to take less "
+                        "space."}},
+    {"-large-copies",
+     {nullptr,
+      "Report copies of globals of at least <bytes> bytes, e.g. passed "
+      "by value. What a global owns doesn't count towards its size.",
+      &options.largeCopies, "<bytes>"}},
+    {"-volatile-loops",
+     {&options.volatileLoops, "Report volatile globals used in loops, "
+                              "as flags or accumulators."}},
+    {"-include-path",
+     {nullptr,
+      "Only analyze files whose path matches <glob>. "
+      "Can be given multiple times.",
+      &options.includePaths}},
+    {"-exclude-path",
+     {nullptr,
+      "Skip files whose path matches <glob>, even if "
+      "included by -include-path. Can be given multiple times.",
+      &options.excludePaths}},
+    {"-changed-lines",
+     {nullptr,
+      "Only report globals declared or used in the changed "
+      "lines listed in <file> (path:first-last per line).",
+      &options.changedLines, "<file>"}},
+    {"-jobs",
+     {nullptr,
+      "Traverse top level declarations on <n> threads. The passes "
+      "still run on the main thread, in source order.",
+      &options.jobs, "<n>"}},
+    {"-sample-rate",
+     {nullptr,
+      "Only analyze one in <n> translation units, a different "
+      "one in every build (see -build-id).",
+      &options.sampleRate, "<1/n>"}},
+    {"-build-id",
+     {nullptr,
+      "Selects the translation units analyzed with -sample-rate. "
+      "Defaults to the current day, a number rotates through them.",
+      &options.buildId, "<id>"}},
+    {"-sample-log",
+     {nullptr,
+      "Record the findings of each analyzed translation unit in "
+      "<dir>, see scripts/collect-sampled-findings.py.",
+      &options.sampleLog, "<dir>"}},
+    {"-record-events",
+     {nullptr,
+      "Write the events the scope engine sees to <file>, or to a file "
+      "named after the TU in <dir>, for bench/rcs_replay.cc.",
+      &options.recordEvents, "<file>"}},
 };
 
 void printHelp() {
 	llvm::errs() << "Plugin options: \n";
 	for (auto &entry : validOptions) {
-		fprintf(stderr, "  %-16s %s\n", entry.first.c_str(),
+		auto name = entry.first;
+		if (entry.second.values) {
+			name += std::string("=") + entry.second.metavar;
+		}
+		fprintf(stderr, "  %-24s %s\n", name.c_str(),
 		        entry.second.help.c_str());
 	}
 }
@@ -75,7 +200,23 @@ void parseArgs(const std::vector<std::string> &args) {
 		exit(1);
 	}
 
-	for (auto &s : args) {
+	for (auto &arg : args) {
+		auto eq = arg.find('=');
+		if (eq != std::string::npos) {
+			auto name = arg.substr(0, eq);
+			if (!validOptions.count(name) ||
+			    !validOptions[name].values) {
+				fatal("unknown option: " + arg);
+			}
+			validOptions[name].values->push_back(arg.substr(eq + 1));
+			verbose("set option ", arg);
+			continue;
+		}
+		auto &s = arg;
+		if (validOptions.count(s) && validOptions[s].values) {
+			fatal("option needs a value: " + s + "=" +
+			      validOptions[s].metavar);
+		}
 		if (validOptions.count(s)) {
 			if (!*(validOptions[s].addr)) {
 				*(validOptions[s].addr) = true;
@@ -89,64 +230,292 @@ void parseArgs(const std::vector<std::string> &args) {
 	}
 }
 
-class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
+// Glob based allow / deny list for source paths, built from -include-path
+// and -exclude-path. Each pattern is compiled once into a GlobPattern and
+// the patterns are tried in turn. Filters are a handful of patterns and
+// the result is cached per file, so a combined automaton isn't worth it.
+class PathFilter {
       private:
-	ASTContext *context;
-	CompilerInstance &instance;
-	CompoundStmt *parentStmt = nullptr;
+	std::vector<llvm::GlobPattern> include, exclude;
 
-	DiagnosticsEngine &d;
+	static void compile(const std::vector<std::string> &globs,
+	                    std::vector<llvm::GlobPattern> &out) {
+		for (auto &glob : globs) {
+			auto pattern = llvm::GlobPattern::create(glob);
+			if (!pattern) {
+				fatal("invalid glob '" + glob + "': " +
+				      llvm::toString(pattern.takeError()));
+			}
+			out.push_back(std::move(*pattern));
+		}
+	}
+
+      public:
+	PathFilter(const std::vector<std::string> &includeGlobs,
+	           const std::vector<std::string> &excludeGlobs) {
+		compile(includeGlobs, include);
+		compile(excludeGlobs, exclude);
+	}
 
-	std::unordered_map<VarDecl *, std::vector<UsageInformation>> usages;
-	std::vector<VarDecl *> globals;
+	bool empty() const { return include.empty() && exclude.empty(); }
 
-	// merges all children of `compound` in vector under `compound`
-	void merge(std::vector<UsageInformation> &v, CompoundStmt *compound,
-	           CompoundStmt *parent) {
-		std::vector<UsageInformation>::iterator itr;
-		for (itr = v.begin(); itr != v.end(); itr++) {
-			if (itr->parent == compound)
-				break;
+	bool allows(llvm::StringRef path) const {
+		for (auto &pattern : exclude) {
+			if (pattern.match(path))
+				return false;
 		}
-		if (itr == v.end()) {
-			return;
+		if (include.empty())
+			return true;
+		for (auto &pattern : include) {
+			if (pattern.match(path))
+				return true;
 		}
-		// merge [itr, end) into one UsageInformation
-		*itr = (UsageInformation){
-		    compound, parent,
-		    std::vector<UsageInformation>(itr, v.end())};
-		v.erase(itr + 1, v.end());
+		return false;
 	}
+};
 
-	int depth = 0;
-	bool declPrinted = false;
-	unsigned int unusedWarning, redundantScopeWarning, usageNote,
-	    usageStmtNote;
+unsigned jobCount() {
+	if (options.jobs.empty())
+		return 1;
+	if (options.jobs.size() > 1)
+		fatal("same option specified twice: -jobs");
+	unsigned n;
+	if (llvm::StringRef(options.jobs.back()).getAsInteger(10, n) || n == 0)
+		fatal("bad value for -jobs: " + options.jobs.back());
+	return n;
+}
 
-	bool isInHeader(Decl *decl) {
-		auto loc = decl->getLocation();
-		auto floc = context->getFullLoc(loc);
-		if (floc.isInSystemHeader())
-			return true;
-		auto file = floc.getFileEntry();
-		if (file == nullptr)
+// n of -sample-rate=1/n, 1 when every TU is analyzed
+unsigned sampleRate() {
+	if (options.sampleRate.empty())
+		return 1;
+	llvm::StringRef value = options.sampleRate.back();
+	value.consume_front("1/");
+	unsigned n;
+	if (value.getAsInteger(10, n) || n == 0)
+		fatal("bad value for -sample-rate: " + options.sampleRate.back());
+	return n;
+}
+
+// Smallest global reported by -large-copies, 0 when disabled
+unsigned largeCopySize() {
+	if (options.largeCopies.empty())
+		return 0;
+	unsigned n;
+	if (llvm::StringRef(options.largeCopies.back()).getAsInteger(10, n) ||
+	    n == 0)
+		fatal("bad value for -large-copies: " +
+		      options.largeCopies.back());
+	return n;
+}
+
+std::string buildId() {
+	if (!options.buildId.empty())
+		return options.buildId.back();
+	auto days = std::chrono::duration_cast<std::chrono::hours>(
+	                std::chrono::system_clock::now().time_since_epoch())
+	                .count() /
+	            24;
+	return std::to_string(days);
+}
+
+// Whether the TU of `mainFile` is in this build's sample. The TUs are
+// split into n fixed groups by the hash of their path, and each build
+// analyzes one group. With numeric build IDs consecutive builds take the
+// groups in turn, so any n consecutive builds cover every TU once.
+bool isSampled(llvm::StringRef mainFile) {
+	auto n = sampleRate();
+	if (n == 1)
+		return true;
+	auto id = buildId();
+	uint64_t slot;
+	if (llvm::StringRef(id).getAsInteger(10, slot))
+		slot = llvm::xxHash64(id);
+	return llvm::xxHash64(mainFile) % n == slot % n;
+}
+
+// compiled on first use, after the plugin arguments are parsed
+const PathFilter &pathFilter() {
+	static PathFilter filter(options.includePaths, options.excludePaths);
+	return filter;
+}
+
+static std::string absolutePath(llvm::StringRef path) {
+	llvm::SmallString<256> result(path);
+	llvm::sys::fs::make_absolute(result);
+	llvm::sys::path::remove_dots(result, true);
+	return result.str().str();
+}
+
+// Same form as FileEntry::tryGetRealPathName(), so that paths given on
+// the command line compare equal to those of the files clang opened.
+static std::string realPath(llvm::StringRef path) {
+	llvm::SmallString<256> result;
+	if (llvm::sys::fs::real_path(path, result))
+		return absolutePath(path);
+	return result.str().str();
+}
+
+// Files whose globals are analyzed, anything else that isn't the main
+// file is a header. Module interface units (.cppm, .ixx) own the globals
+// they declare.
+static bool isSourceFileName(llvm::StringRef name) {
+	return name.endswith(".cpp") || name.endswith(".cc") ||
+	       name.endswith(".cxx") || name.endswith(".c") ||
+	       name.endswith(".cppm") || name.endswith(".ixx");
+}
+
+// Declared inside an `export` block or declaration, directly or through
+// enclosing namespaces.
+static bool isExported(Decl *decl) {
+	for (auto dc = decl->getLexicalDeclContext(); dc;
+	     dc = dc->getLexicalParent()) {
+		if (dc->getDeclKind() == Decl::Export)
 			return true;
-		auto entry = file->getName();
-		if (entry.endswith(".cpp") || entry.endswith(".cc") ||
-		    entry.endswith(".c")) {
-			return false;
+	}
+	return false;
+}
+
+std::string ChangeSet::normalize(llvm::StringRef path) {
+	return realPath(path);
+}
+
+bool ChangeSet::load(llvm::StringRef listFile, std::string &error) {
+	auto buffer = llvm::MemoryBuffer::getFile(listFile);
+	if (!buffer) {
+		error = "cannot read " + listFile.str() + ": " +
+		        buffer.getError().message();
+		return false;
+	}
+	llvm::SmallVector<llvm::StringRef, 64> lines;
+	(*buffer)->getBuffer().split(lines, '\n', -1, false);
+	for (auto line : lines) {
+		line = line.trim();
+		if (line.empty() || line.startswith("#"))
+			continue;
+		// "path:ranges", but paths may contain ':' themselves
+		auto split = line.rsplit(':');
+		std::vector<std::pair<unsigned, unsigned>> ranges;
+		bool hasRanges = !split.second.empty() &&
+		                 split.second.find_first_not_of("0123456789-,") ==
+		                     llvm::StringRef::npos;
+		if (hasRanges) {
+			llvm::SmallVector<llvm::StringRef, 4> parts;
+			split.second.split(parts, ',', -1, false);
+			for (auto part : parts) {
+				auto bounds = part.split('-');
+				unsigned first, last;
+				if (bounds.first.getAsInteger(10, first)) {
+					error = "bad line range in " +
+					        listFile.str() + ": " + line.str();
+					return false;
+				}
+				last = first;
+				if (!bounds.second.empty() &&
+				    bounds.second.getAsInteger(10, last)) {
+					error = "bad line range in " +
+					        listFile.str() + ": " + line.str();
+					return false;
+				}
+				ranges.push_back({first, last});
+			}
+		}
+		auto path = normalize(hasRanges ? split.first : line);
+		auto existing = files.find(path);
+		if (existing == files.end()) {
+			files[path] = ranges;
+		} else if (!existing->second.empty()) {
+			if (ranges.empty()) {
+				existing->second.clear();
+			} else {
+				existing->second.insert(existing->second.end(),
+				                        ranges.begin(),
+				                        ranges.end());
+			}
+		}
+	}
+	return true;
+}
+
+void ChangeSet::write(llvm::raw_ostream &os) const {
+	for (auto &entry : files) {
+		os << entry.first();
+		const char *separator = ":";
+		for (auto &range : entry.second) {
+			os << separator << range.first << "-" << range.second;
+			separator = ",";
 		}
+		os << "\n";
+	}
+}
+
+bool ChangeSet::containsFile(llvm::StringRef path) const {
+	return files.count(path);
+}
+
+bool ChangeSet::containsLine(llvm::StringRef path, unsigned line) const {
+	auto entry = files.find(path);
+	if (entry == files.end())
+		return false;
+	if (entry->second.empty())
 		return true;
+	for (auto &range : entry->second) {
+		if (range.first <= line && line <= range.second)
+			return true;
 	}
+	return false;
+}
 
-      public:
-	void mergeAll(CompoundStmt *stmt, CompoundStmt *parent) {
-		for (auto &entry : usages) {
-			auto &uses = entry.second;
-			if (uses.empty()) {
+ChangeSet &changeSet() {
+	static ChangeSet changes;
+	return changes;
+}
+
+// Globals of the translation unit and their uses, shared by all passes.
+// The uses of each global are merged into a tree of the blocks containing
+// them as the traversal leaves each block.
+using GlobalTable = ScopeTable<VarDecl, Stmt, CompoundStmt>;
+
+// How a reference uses a variable: reads its value, writes (a part of)
+// it, or lets its address escape to code that may write through it.
+enum class Access { Read, Write, ReadWrite, Escape };
+
+static bool isLoop(const Stmt *stmt) {
+	return isa<ForStmt>(stmt) || isa<CXXForRangeStmt>(stmt) ||
+	       isa<WhileStmt>(stmt) || isa<DoStmt>(stmt);
+}
+
+// An analysis of global variables. All passes are fed from the single
+// traversal in ScopeCheckerVisitor, and report their findings in finish().
+// The table is already updated when a pass sees an event.
+class GlobalAnalysisPass {
+      protected:
+	ASTContext *context;
+	DiagnosticsEngine &d;
+	GlobalTable &table;
+	// references to the globals passed to track(), by canonical decl
+	llvm::DenseMap<VarDecl *, std::vector<DeclRefExpr *>> references;
+
+	// Collects the references to `decl` for forEachTracked()
+	void track(VarDecl *decl) { references[decl]; }
+
+	// Calls `report` once per tracked global, with its references, in
+	// table order. Ignored and, with -changed-lines, untouched globals
+	// are skipped.
+	void forEachTracked(
+	    llvm::function_ref<void(VarDecl *, std::vector<DeclRefExpr *> &)>
+	        report) {
+		for (auto vdecl : table.globals) {
+			auto found = references.find(vdecl);
+			if (found == references.end()) {
 				continue;
 			}
-			merge(uses, stmt, parent);
+			auto refs = std::move(found->second);
+			// a redeclared global is listed once per declaration
+			references.erase(found);
+			if (!isRcsIgnore(vdecl) && isReportable(vdecl)) {
+				report(vdecl, refs);
+			}
 		}
 	}
 
@@ -167,24 +536,355 @@ class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
 		return false;
 	}
 
+	bool isChanged(SourceLocation loc) {
+		auto &sm = context->getSourceManager();
+		auto expansion = sm.getExpansionLoc(loc);
+		auto file = sm.getFileEntryForID(sm.getFileID(expansion));
+		if (file == nullptr)
+			return false;
+		auto path = file->tryGetRealPathName();
+		return changeSet().containsLine(
+		    path.empty() ? realPath(file->getName()) : path.str(),
+		    sm.getExpansionLineNumber(expansion));
+	}
+
+	bool isChanged(std::vector<UsageInformation> &uses) {
+		for (auto &use : uses) {
+			if (use.children.empty()
+			        ? isChanged(use.usedIn->getBeginLoc())
+			        : isChanged(use.children)) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// with -changed-lines, only globals whose declaration or uses were
+	// touched are reported
+	bool isReportable(VarDecl *vdecl) {
+		if (changeSet().empty())
+			return true;
+		return isChanged(vdecl->getLocation()) ||
+		       isChanged(table.usages[vdecl]);
+	}
+
 	bool hasSideEffectInit(VarDecl *decl) {
 		auto init = decl->getInit();
-		auto langOpts = context->getLangOpts();
 		if (init == nullptr || init->isEvaluatable(*context)) {
 			return false;
 		}
 		return true;
 	}
 
-	void printRedundant() {
-		for (auto &vdecl: globals) {
+	// A pointer or reference parameter only reads what it points to if
+	// that is const. Variadic and indirect calls may do anything.
+	static Access argumentAccess(const FunctionDecl *callee,
+	                             unsigned index) {
+		if (!callee || index >= callee->getNumParams()) {
+			return Access::Escape;
+		}
+		auto type = callee->getParamDecl(index)->getType();
+		if (!type->isPointerType() && !type->isReferenceType()) {
+			return Access::Read;
+		}
+		if (type->getPointeeType().isConstQualified()) {
+			return Access::Read;
+		}
+		return Access::Escape;
+	}
+
+	// `arg` is an argument of `call`, a function or constructor call
+	static Access argumentAccess(const Expr *call, const Expr *arg) {
+		auto construct = dyn_cast<CXXConstructExpr>(call);
+		auto function = dyn_cast<CallExpr>(call);
+		const FunctionDecl *callee = construct
+		                                 ? construct->getConstructor()
+		                                 : function->getDirectCallee();
+		auto count = construct ? construct->getNumArgs()
+		                       : function->getNumArgs();
+		for (unsigned i = 0; i < count; i++) {
+			auto candidate = construct ? construct->getArg(i)
+			                           : function->getArg(i);
+			if (candidate != arg) {
+				continue;
+			}
+			// the object of a member operator comes first
+			auto method = dyn_cast_or_null<CXXMethodDecl>(callee);
+			if (isa<CXXOperatorCallExpr>(call) && method) {
+				if (i == 0 && method->isConst())
+					return Access::Read;
+				if (i == 0)
+					return Access::ReadWrite;
+				return argumentAccess(callee, i - 1);
+			}
+			return argumentAccess(callee, i);
+		}
+		// the callee
+		return Access::Read;
+	}
+
+	// Walks up from `ref` through the expressions that designate (a part
+	// of) the variable, or its address, to the one that uses it. Uses the
+	// parent map, so call it once the whole TU is parsed, e.g. in finish().
+	Access accessOf(const Expr *ref) {
+		const Expr *e = ref;
+		// `e` is the address of the variable, or of a part of it
+		bool address = false;
+		while (true) {
+			auto parents = context->getParents(*e);
+			if (parents.empty()) {
+				return Access::Read;
+			}
+			auto parent = parents[0].get<Expr>();
+			if (!parent) {
+				// initializes a variable, or is returned
+				auto var = parents[0].get<VarDecl>();
+				auto type = var ? var->getType() : e->getType();
+				bool indirect = type->isPointerType() ||
+				                type->isReferenceType();
+				if (!indirect)
+					return Access::Read;
+				if ((!var && !address) ||
+				    type->getPointeeType().isConstQualified())
+					return Access::Read;
+				return Access::Escape;
+			}
+			auto unary = dyn_cast<UnaryOperator>(parent);
+			auto binary = dyn_cast<BinaryOperator>(parent);
+			auto cast = dyn_cast<CastExpr>(parent);
+			if (cast && cast->getCastKind() == CK_LValueToRValue) {
+				return Access::Read;
+			} else if (cast) {
+				auto kind = cast->getCastKind();
+				address |= kind == CK_ArrayToPointerDecay;
+			} else if (auto subscript =
+			               dyn_cast<ArraySubscriptExpr>(parent)) {
+				// as the index, the value is read
+				if (subscript->getBase() != e)
+					return Access::Read;
+				address = false;
+			} else if (auto member = dyn_cast<MemberExpr>(parent)) {
+				auto method = dyn_cast<CXXMethodDecl>(
+				    member->getMemberDecl());
+				if (method && method->isConst())
+					return Access::Read;
+				if (method)
+					return Access::ReadWrite;
+				address = false;
+			} else if (unary && unary->isIncrementDecrementOp()) {
+				return Access::ReadWrite;
+			} else if (unary && unary->getOpcode() == UO_AddrOf) {
+				address = true;
+			} else if (unary && unary->getOpcode() == UO_Deref) {
+				address = false;
+			} else if (binary && binary->isAssignmentOp() &&
+			           binary->getLHS() == e) {
+				return binary->getOpcode() == BO_Assign
+				           ? Access::Write
+				           : Access::ReadWrite;
+			} else if (binary) {
+				// pointer arithmetic stays on the variable
+				bool arithmetic =
+				    address && binary->isAdditiveOp();
+				bool comma = binary->getOpcode() == BO_Comma &&
+				             binary->getRHS() == e;
+				if (!arithmetic && !comma)
+					return Access::Read;
+			} else if (isa<CallExpr>(parent) ||
+			           isa<CXXConstructExpr>(parent)) {
+				return argumentAccess(parent, e);
+			} else if (!isa<ParenExpr>(parent) &&
+			           !isa<MaterializeTemporaryExpr>(parent) &&
+			           !isa<FullExpr>(parent)) {
+				return address ? Access::Escape : Access::Read;
+			}
+			e = parent;
+		}
+	}
+
+	// The loop `stmt` is in, within its function
+	const Stmt *innermostLoop(const Stmt *stmt) {
+		auto node = DynTypedNode::create(*stmt);
+		while (true) {
+			auto parents = context->getParents(node);
+			if (parents.empty() || parents[0].get<Decl>()) {
+				return nullptr;
+			}
+			node = parents[0];
+			auto parent = node.get<Stmt>();
+			if (parent && isLoop(parent)) {
+				return parent;
+			}
+		}
+	}
+
+	// The function `stmt` is in, and whether it is in a loop there.
+	const FunctionDecl *enclosingFunction(const Stmt *stmt, bool &inLoop) {
+		inLoop = false;
+		auto node = DynTypedNode::create(*stmt);
+		while (true) {
+			auto parents = context->getParents(node);
+			if (parents.empty()) {
+				return nullptr;
+			}
+			node = parents[0];
+			if (auto function = node.get<FunctionDecl>()) {
+				return function;
+			}
+			if (auto parent = node.get<Stmt>()) {
+				inLoop |= isLoop(parent);
+			}
+		}
+	}
+
+      public:
+	GlobalAnalysisPass(ASTContext *context, DiagnosticsEngine &d,
+	                   GlobalTable &table)
+	    : context(context), d(d), table(table) {}
+	virtual ~GlobalAnalysisPass() = default;
+
+	virtual void onGlobal(VarDecl *decl) {}
+	virtual void onReference(VarDecl *decl, DeclRefExpr *ref,
+	                         CompoundStmt *scope) {
+		auto found = references.find(decl);
+		if (found != references.end()) {
+			found->second.push_back(ref);
+		}
+	}
+	// `loopDepth` counts the loops around the block, in the function
+	// and in the functions (lambdas) it is nested in
+	virtual void onScopeEnter(CompoundStmt *stmt, unsigned loopDepth) {}
+	virtual void onScopeExit(CompoundStmt *stmt, CompoundStmt *parent) {}
+	// reference to a global with external linkage that is not tracked,
+	// usually one declared in a (non system) header
+	virtual void onExternalReference(VarDecl *decl, DeclRefExpr *ref) {}
+	// a variable declared at file scope in a header, and a reference to
+	// a variable found in a header (`decl` is the found decl)
+	virtual void onHeaderGlobal(VarDecl *decl) {}
+	virtual void onHeaderReference(VarDecl *decl, DeclRefExpr *ref) {}
+	// a local with automatic storage, with -hoist-locals
+	virtual void onLocal(VarDecl *decl, unsigned loopDepth) {}
+	virtual void finish() {}
+};
+
+// The original check: globals that are unused, or only used in a single
+// block.
+class RedundantScopePass : public GlobalAnalysisPass {
+      private:
+	unsigned int unusedWarning, redundantScopeWarning, usageNote,
+	    usageStmtNote, loopNote;
+	// blocks inside a loop, others are at depth 0
+	llvm::DenseMap<CompoundStmt *, unsigned> loopDepths;
+
+	unsigned loopDepth(Stmt *stmt) {
+		auto found = loopDepths.find(cast<CompoundStmt>(stmt));
+		return found == loopDepths.end() ? 0 : found->second;
+	}
+
+	// Small trivially copyable objects with a constant initializer cost
+	// next to nothing to construct, they can go inside a loop.
+	bool isCheapToConstruct(VarDecl *vdecl) {
+		auto type = vdecl->getType();
+		if (type->isDependentType() || type->isIncompleteType() ||
+		    !type.isTriviallyCopyableType(*context) ||
+		    type.isDestructedType()) {
+			return false;
+		}
+		// about a cache line, larger arrays are copied on every iteration
+		if (context->getTypeSizeInChars(type).getQuantity() > 64) {
+			return false;
+		}
+		return !hasSideEffectInit(vdecl);
+	}
+
+	// The block to move the global to: the innermost block containing all
+	// uses, unless that is in a loop the function body isn't in. Then the
+	// move would construct it on every iteration, so unless that's cheap
+	// suggest the innermost block outside the loops.
+	UsageInformation *placement(VarDecl *vdecl, UsageInformation &outest) {
+		auto innermost = &outest, outsideLoops = &outest;
+		auto base = loopDepth(outest.usedIn);
+		while (innermost->children.size() == 1 &&
+		       !innermost->children[0].children.empty()) {
+			innermost = &innermost->children[0];
+			if (loopDepth(innermost->usedIn) == base) {
+				outsideLoops = innermost;
+			}
+		}
+		if (innermost == outsideLoops || isCheapToConstruct(vdecl)) {
+			return nullptr;
+		}
+		return outsideLoops;
+	}
+
+	// Notes the blocks down to `target`, the block from placement(), or
+	// down to the uses when there is none. Past the target only the uses
+	// are noted, the blocks in the loop aren't where it should go.
+	void printNotes(VarDecl *vdecl, std::vector<UsageInformation> &uses,
+	                UsageInformation *target) {
+		for (auto &use : uses) {
+			auto loc =
+			    context->getFullLoc((use.usedIn)->getBeginLoc());
+			if (use.children.empty()) {
+				d.Report(loc, usageStmtNote);
+			} else if (&use == target) {
+				d.Report(loc, loopNote);
+				printUses(use.children);
+			} else {
+				d.Report(loc, usageNote);
+				printNotes(vdecl, use.children, target);
+			}
+		}
+	}
+
+	void printUses(std::vector<UsageInformation> &uses) {
+		for (auto &use : uses) {
+			if (use.children.empty()) {
+				d.Report(context->getFullLoc(
+				             (use.usedIn)->getBeginLoc()),
+				         usageStmtNote);
+			} else {
+				printUses(use.children);
+			}
+		}
+	}
+
+      public:
+	RedundantScopePass(ASTContext *context, DiagnosticsEngine &d,
+	                   GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		unusedWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning, "Unused global variable: '%0'. "
+						"You can remove it.");
+		redundantScopeWarning =
+		    d.getCustomDiagID(DiagnosticsEngine::Warning,
+		                      "variable %0 only used in a smaller "
+		                      "scope, consider moving it.");
+		usageNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note, ":::::::: In this block ::::::::");
+		usageStmtNote =
+		    d.getCustomDiagID(DiagnosticsEngine::Note, "Used here.");
+		loopNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "move it to this block, the uses are inside a loop which "
+		    "would construct it on every iteration");
+	}
+
+	void onScopeEnter(CompoundStmt *stmt, unsigned loopDepth) override {
+		if (loopDepth) {
+			loopDepths[stmt] = loopDepth;
+		}
+	}
+
+	void finish() override {
+		for (auto &vdecl: table.globals) {
 			if (isRcsIgnore(vdecl)) {
 				continue;
 			}
 			if (hasSideEffectInit(vdecl) && !options.warnInit) {
 				continue;
 			}
-			auto &uses = usages[vdecl];
+			auto &uses = table.usages[vdecl];
 
 			// used in multiple places
 			if (uses.size() > 1) {
@@ -197,6 +897,15 @@ class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
 				continue;
 			}
 
+			// exported from a module interface, importers use it
+			if (isExported(vdecl)) {
+				continue;
+			}
+
+			if (!isReportable(vdecl)) {
+				continue;
+			}
+
 			auto loc = context->getFullLoc(vdecl->getLocation());
 			if (uses.empty()) {
 				if (!options.noWarnUnused) {
@@ -215,90 +924,2510 @@ class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
 			if (outest != nullptr) {
 				d.Report(loc, redundantScopeWarning)
 				    << vdecl->getNameAsString();
+				auto block = placement(vdecl, uses[0]);
 				if (!options.noShowUsages) {
-					printNotes(vdecl, uses);
+					printNotes(vdecl, uses, block);
+				} else if (block) {
+					d.Report(context->getFullLoc(
+					             block->usedIn->getBeginLoc()),
+					         loopNote);
 				}
 			}
 		}
 	}
+};
 
-	void printNotes(VarDecl *vdecl, std::vector<UsageInformation> &uses) {
-		for (auto &use : uses) {
-			if (use.children.empty()) {
-				auto loc = context->getFullLoc(
-				    (use.usedIn)->getBeginLoc());
-				d.Report(loc, usageStmtNote);
-			} else {
-				auto loc = context->getFullLoc(
-				    (use.usedIn)->getBeginLoc());
-				d.Report(loc, usageNote);
-				printNotes(vdecl, use.children);
-			}
-		}
-	}
+// The inverse problem: locals built from constants on every call, like a
+// std::regex or a lookup table, which could be built once. Reported by
+// the loops around them, then by the cost of building them.
+class HoistLocalPass : public GlobalAnalysisPass {
+      private:
+	unsigned int hoistWarning;
 
-	explicit ScopeCheckerVisitor(ASTContext *context,
-	                             CompilerInstance &instance)
-	    : context(context), instance(instance),
-	      d(instance.getDiagnostics()) {
-		unusedWarning = d.getCustomDiagID(
-		    DiagnosticsEngine::Warning, "Unused global variable: '%0'. "
-						"You can remove it.");
-		redundantScopeWarning =
-		    d.getCustomDiagID(DiagnosticsEngine::Warning,
-		                      "variable %0 only used in a smaller "
-		                      "scope, consider moving it.");
-		usageNote = d.getCustomDiagID(
-		    DiagnosticsEngine::Note, ":::::::: In this block ::::::::");
-		usageStmtNote =
-		    d.getCustomDiagID(DiagnosticsEngine::Note, "Used here.");
-	}
+	struct Candidate {
+		VarDecl *decl;
+		unsigned loopDepth;
+		unsigned cost;
+		bool constexprInit;
+	};
+	std::vector<Candidate> candidates;
+	// one per function body, the analyzer caches its matches
+	llvm::DenseMap<const Stmt *, std::unique_ptr<ExprMutationAnalyzer>>
+	    analyzers;
 
-	bool VisitDeclRefExpr(DeclRefExpr *e) {
-		if (const auto decl = e->getFoundDecl()) {
-			if (isInHeader(decl)) {
-				return true;
+	// literals, and objects constructed from them
+	bool isBuiltFromConstants(const Expr *e) {
+		while (true) {
+			auto inner = e->IgnoreImplicit()->IgnoreParens();
+			// std::string("...") and friends
+			if (auto cast = dyn_cast<ExplicitCastExpr>(inner)) {
+				inner = cast->getSubExpr();
 			}
-			if (decl->getKind() == Decl::Kind::Var) {
-				VarDecl *vd = dynamic_cast<VarDecl *>(decl)
-						  ->getCanonicalDecl();
-				if (usages.count(vd)) {
-					// add the current compound statement to
-					// usages vector
-					usages[vd].push_back((UsageInformation){
-					    e, parentStmt, {}});
+			if (inner == e) {
+				break;
+			}
+			e = inner;
+		}
+		if (e->isValueDependent()) {
+			return false;
+		}
+		if (isa<StringLiteral>(e) || e->isEvaluatable(*context)) {
+			return true;
+		}
+		if (auto construct = dyn_cast<CXXConstructExpr>(e)) {
+			// default construction isn't built from anything
+			if (construct->getNumArgs() == 0 ||
+			    isa<CXXDefaultArgExpr>(construct->getArg(0))) {
+				return false;
+			}
+			for (auto arg : construct->arguments()) {
+				if (!isBuiltFromConstants(arg)) {
+					return false;
 				}
 			}
+			return true;
 		}
-		return true;
-	}
-
-	bool VisitVarDecl(VarDecl *decl) {
-		// Ignore variables defined in headers
-		if (isInHeader(decl)) {
+		if (auto list = dyn_cast<InitListExpr>(e)) {
+			for (auto init : list->inits()) {
+				if (!isBuiltFromConstants(init)) {
+					return false;
+				}
+			}
 			return true;
 		}
-		// ignore function parameters
-		if (auto const pd = dynamic_cast<ParmVarDecl *>(decl)) {
+		if (auto list = dyn_cast<CXXStdInitializerListExpr>(e)) {
+			return isBuiltFromConstants(list->getSubExpr());
+		}
+		if (auto arg = dyn_cast<CXXDefaultArgExpr>(e)) {
+			return isBuiltFromConstants(arg->getExpr());
+		}
+		return false;
+	}
+
+	// A static local is built once and destroyed at exit, so only values
+	// whose destructor does nothing else than freeing memory can be
+	// hoisted: a scoped timer or a lock would change behavior.
+	bool isPlainValue(QualType type) {
+		if (type.isDestructedType() == QualType::DK_none)
 			return true;
+		auto record = context->getBaseElementType(type)
+		                  ->getAsCXXRecordDecl();
+		if (!record || !record->isInStdNamespace())
+			return false;
+		return llvm::StringSwitch<bool>(record->getName())
+		    .Cases("basic_string", "vector", "array", "deque", "list",
+		           "forward_list", true)
+		    .Cases("map", "multimap", "set", "multiset", true)
+		    .Cases("unordered_map", "unordered_multimap",
+		           "unordered_set", "unordered_multiset", true)
+		    .Cases("basic_regex", "locale", "bitset", true)
+		    .Default(false);
+	}
+
+	static unsigned countConstructors(const Stmt *stmt) {
+		unsigned count = 0;
+		if (auto construct = dyn_cast<CXXConstructExpr>(stmt)) {
+			count += !construct->getConstructor()->isTrivial();
 		}
-		if (depth == 0) {
-			auto cd = decl->getCanonicalDecl();
-			globals.push_back(cd);
-			usages[cd] = {};
+		for (auto child : stmt->children()) {
+			if (child) {
+				count += countConstructors(child);
+			}
 		}
-		return true;
+		return count;
 	}
 
-	bool VisitDecl(Decl *decl) {
-		if (!isInHeader(decl) && options.dumpAst && !declPrinted) {
-			decl->dumpColor();
-			declPrinted = true;
+	// Rough cost of building the local: non trivial constructors run,
+	// plus cache lines written. A regex compiles its pattern and a locale
+	// loads its facets, they count as many allocations.
+	unsigned constructionCost(VarDecl *decl) {
+		auto type = decl->getType();
+		unsigned cost =
+		    context->getTypeSizeInChars(type).getQuantity() / 64 +
+		    countConstructors(decl->getInit());
+		auto record = context->getBaseElementType(type)
+		                  ->getAsCXXRecordDecl();
+		if (record && record->isInStdNamespace() &&
+		    (record->getName() == "basic_regex" ||
+		     record->getName() == "locale")) {
+			cost += 64;
 		}
-		return true;
+		return cost;
 	}
 
-	// a scope generally begins with a compound statement
+	// A local of a for statement's init is built once, before the loop
+	// runs, although the traversal counts it in the loop.
+	bool isLoopInit(const VarDecl *decl) {
+		auto parents = context->getParents(*decl);
+		auto declStmt =
+		    parents.empty() ? nullptr : parents[0].get<DeclStmt>();
+		if (!declStmt) {
+			return false;
+		}
+		parents = context->getParents(*declStmt);
+		if (parents.empty()) {
+			return false;
+		}
+		if (auto loop = parents[0].get<ForStmt>()) {
+			return loop->getInit() == declStmt;
+		}
+		if (auto loop = parents[0].get<CXXForRangeStmt>()) {
+			return loop->getInit() == declStmt;
+		}
+		return false;
+	}
+
+	bool isMutated(VarDecl *decl, FunctionDecl *function) {
+		auto body = function->getBody();
+		auto &analyzer = analyzers[body];
+		if (!analyzer) {
+			analyzer.reset(new ExprMutationAnalyzer(*body, *context));
+		}
+		return analyzer->isMutated(decl);
+	}
+
+      public:
+	HoistLocalPass(ASTContext *context, DiagnosticsEngine &d,
+	               GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		hoistWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 is built from constants on every "
+		    "%select{call|loop iteration}1, consider making it "
+		    "%select{'static const'|'constexpr'}2 (construction cost "
+		    "%3)");
+	}
+
+	void onLocal(VarDecl *decl, unsigned loopDepth) override {
+		auto type = decl->getType();
+		auto init = decl->getInit();
+		auto function = dyn_cast_or_null<FunctionDecl>(
+		    decl->getParentFunctionOrMethod());
+		if (!init || !function || !function->getBody() ||
+		    decl->isImplicit() || decl->isConstexpr() ||
+		    decl->isCXXForRangeDecl() || decl->isExceptionVariable() ||
+		    isa<DecompositionDecl>(decl) || type->isReferenceType() ||
+		    type.isVolatileQualified() || type->isDependentType() ||
+		    type->isIncompleteType() || type->isVariablyModifiedType() ||
+		    decl->getDeclContext()->isDependentContext()) {
+			return;
+		}
+		if (isRcsIgnore(decl) || !isPlainValue(type) ||
+		    !isBuiltFromConstants(init)) {
+			return;
+		}
+		auto cost = constructionCost(decl);
+		if (cost == 0) {
+			return;
+		}
+		// a returned local is constructed in place, a static one would
+		// be copied
+		if (decl->isNRVOVariable()) {
+			return;
+		}
+		if (!type.isConstQualified() && isMutated(decl, function)) {
+			return;
+		}
+		bool constexprInit = context->getLangOpts().CPlusPlus11 &&
+		                     type->isLiteralType(*context) &&
+		                     init->isCXX11ConstantExpr(*context);
+		// no statics in a constexpr function
+		if (function->isConstexpr() && !constexprInit) {
+			return;
+		}
+		if (isLoopInit(decl)) {
+			loopDepth--;
+		}
+		candidates.push_back({decl, loopDepth, cost, constexprInit});
+	}
+
+	void finish() override {
+		auto rank = [](const Candidate &a, const Candidate &b) {
+			if (a.loopDepth != b.loopDepth)
+				return a.loopDepth > b.loopDepth;
+			return a.cost > b.cost;
+		};
+		std::stable_sort(candidates.begin(), candidates.end(), rank);
+		for (auto &candidate : candidates) {
+			auto decl = candidate.decl;
+			if (!changeSet().empty() &&
+			    !isChanged(decl->getLocation())) {
+				continue;
+			}
+			d.Report(context->getFullLoc(decl->getLocation()),
+			         hoistWarning)
+			    << decl << (candidate.loopDepth > 0)
+			    << candidate.constexprInit << candidate.cost;
+		}
+	}
+};
+
+// Globals whose constant initializer holds addresses. In a PIE or a
+// shared object each address is a dynamic relocation, applied by the
+// dynamic linker at load time, and the page it is in is no longer shared.
+class RelocationPass : public GlobalAnalysisPass {
+      private:
+	unsigned int relocationWarning, arrayNote, fixedWidthNote, offsetsNote,
+	    constNote, indexNote;
+
+	struct Relocations {
+		uint64_t count = 0;
+		// those pointing to string literals
+		uint64_t strings = 0;
+		uint64_t stringBytes = 0;
+		uint64_t longestString = 0;
+	};
+
+	void addPointer(const APValue::LValueBase &base, Relocations &found,
+	                uint64_t times) {
+		found.count += times;
+		auto expr = base.dyn_cast<const Expr *>();
+		if (auto string = dyn_cast_or_null<StringLiteral>(expr)) {
+			// with the terminating NUL
+			uint64_t bytes = string->getByteLength() + 1;
+			found.strings += times;
+			found.stringBytes += bytes * times;
+			found.longestString =
+			    std::max(found.longestString, bytes);
+		}
+	}
+
+	// Adds the relocations of `value`, of type `type`, `times` over
+	void count(const APValue &value, QualType type, Relocations &found,
+	           uint64_t times = 1) {
+		switch (value.getKind()) {
+		case APValue::LValue:
+			// a null pointer, or an integer cast to a pointer
+			if (!value.getLValueBase()) {
+				return;
+			}
+			addPointer(value.getLValueBase(), found, times);
+			return;
+		case APValue::MemberPointer: {
+			auto method = dyn_cast_or_null<CXXMethodDecl>(
+			    value.getMemberPointerDecl());
+			// others are offsets
+			if (method && !method->isVirtual()) {
+				found.count += times;
+			}
+			return;
+		}
+		case APValue::Array: {
+			auto element =
+			    context->getAsArrayType(type)->getElementType();
+			auto initialized = value.getArrayInitializedElts();
+			for (unsigned i = 0; i < initialized; i++) {
+				count(value.getArrayInitializedElt(i), element,
+				      found, times);
+			}
+			if (value.hasArrayFiller()) {
+				auto filled = value.getArraySize() - initialized;
+				count(value.getArrayFiller(), element, found,
+				      times * filled);
+			}
+			return;
+		}
+		case APValue::Struct: {
+			auto record = type->getAsCXXRecordDecl();
+			if (record) {
+				unsigned i = 0;
+				bool baseHasVtable = false;
+				for (auto &base : record->bases()) {
+					count(value.getStructBase(i++),
+					      base.getType(), found, times);
+					baseHasVtable |= base.getType()
+					                     ->getAsCXXRecordDecl()
+					                     ->isDynamicClass();
+				}
+				// the vtable pointer, shared with a base that has one
+				if (record->isDynamicClass() && !baseHasVtable) {
+					found.count += times;
+				}
+			}
+			for (auto field : type->getAsRecordDecl()->fields()) {
+				auto &fieldValue =
+				    value.getStructField(field->getFieldIndex());
+				count(fieldValue, field->getType(), found,
+				      times);
+			}
+			return;
+		}
+		case APValue::Union:
+			if (auto field = value.getUnionField()) {
+				count(value.getUnionValue(), field->getType(),
+				      found, times);
+			}
+			return;
+		default:
+			return;
+		}
+	}
+
+	// A pointer only becomes an array if no code can point it elsewhere
+	bool isNeverWritten(VarDecl *vdecl) {
+		if (vdecl->isExternallyVisible()) {
+			return false;
+		}
+		for (auto ref : references[vdecl]) {
+			if (accessOf(ref) != Access::Read) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+      public:
+	RelocationPass(ASTContext *context, DiagnosticsEngine &d,
+	               GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		relocationWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 needs %1 dynamic %plural{1:relocation|:relocations}1 "
+		    "at load time in position independent code");
+		arrayNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "declare it as an array, '%select{const|constexpr}0 char "
+		    "%1[]', which needs none");
+		fixedWidthNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "a fixed width table, 'const char %0[][%1]', needs none "
+		    "(%2 bytes)");
+		offsetsNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "keep the strings in one char array and store offsets into "
+		    "it instead of pointers");
+		constNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "declare the pointers 'const' ('T *const') so that they are "
+		    "read-only once relocated");
+		indexNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "store indices into a table instead of pointers to avoid "
+		    "the relocations");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		if (decl->getType()->isPointerType()) {
+			track(decl);
+		}
+	}
+
+	void finish() override {
+		llvm::DenseSet<VarDecl *> seen;
+		for (auto vdecl : table.globals) {
+			if (!seen.insert(vdecl).second || isRcsIgnore(vdecl) ||
+			    !isReportable(vdecl)) {
+				continue;
+			}
+			const VarDecl *definition = nullptr;
+			auto init = vdecl->getAnyInitializer(definition);
+			if (!init || init->isValueDependent() ||
+			    definition->getType()->isDependentType()) {
+				continue;
+			}
+			// dynamically initialized, nothing for the linker to do
+			auto value = definition->evaluateValue();
+			if (!value) {
+				continue;
+			}
+			auto type = definition->getType();
+			Relocations found;
+			count(*value, type, found);
+			if (!found.count) {
+				continue;
+			}
+			auto loc =
+			    context->getFullLoc(definition->getLocation());
+			d.Report(loc, relocationWarning)
+			    << definition << (unsigned)found.count;
+
+			auto element = context->getBaseElementType(type);
+			bool onlyStrings = found.strings == found.count;
+			auto fixedWidthBytes = found.longestString * found.count;
+			if (onlyStrings && type->isPointerType()) {
+				if (isNeverWritten(vdecl)) {
+					d.Report(loc, arrayNote)
+					    << context->getLangOpts().CPlusPlus11
+					    << definition->getName();
+				}
+			} else if (onlyStrings && element->isPointerType() &&
+			           fixedWidthBytes <= 2 * found.stringBytes) {
+				// wastes at most half of the table on padding
+				d.Report(loc, fixedWidthNote)
+				    << definition->getName()
+				    << (unsigned)found.longestString
+				    << (unsigned)fixedWidthBytes;
+			} else if (onlyStrings) {
+				d.Report(loc, offsetsNote);
+			} else if (!element.isConstQualified()) {
+				d.Report(loc, constNote);
+			} else {
+				d.Report(loc, indexNote);
+			}
+		}
+	}
+};
+
+// Global arrays, such as CRC tables, filled at startup by loops in one
+// function that only compute from constants. A constexpr function can
+// generate them at compile time, into read-only data.
+class StartupTablePass : public GlobalAnalysisPass {
+      private:
+	unsigned int tableWarning, generatorNote;
+
+	// Whether `stmt` could be evaluated in a constexpr function: it only
+	// uses its own locals, constants, `table` and constexpr functions.
+	bool isConstantEvaluable(const Stmt *stmt, const FunctionDecl *function,
+	                         const VarDecl *table) {
+		if (isa<CXXNewExpr>(stmt) || isa<CXXDeleteExpr>(stmt) ||
+		    isa<CXXThrowExpr>(stmt) || isa<CXXTryStmt>(stmt) ||
+		    isa<AsmStmt>(stmt) || isa<GotoStmt>(stmt) ||
+		    isa<IndirectGotoStmt>(stmt) || isa<CXXThisExpr>(stmt) ||
+		    isa<CXXReinterpretCastExpr>(stmt)) {
+			return false;
+		}
+		// a C style cast between unrelated pointers is one too
+		auto cast = dyn_cast<CastExpr>(stmt);
+		if (cast && cast->getCastKind() == CK_BitCast) {
+			return false;
+		}
+		// constexpr functions can't read volatile objects
+		auto expr = dyn_cast<Expr>(stmt);
+		if (expr && expr->getType().isVolatileQualified()) {
+			return false;
+		}
+		if (auto declStmt = dyn_cast<DeclStmt>(stmt)) {
+			for (auto decl : declStmt->decls()) {
+				auto var = dyn_cast<VarDecl>(decl);
+				if (var && !var->hasLocalStorage()) {
+					return false;
+				}
+				// uninitialized locals need C++20
+				if (var && !var->hasInit() &&
+				    var->getType().isTrivialType(*context)) {
+					return false;
+				}
+			}
+		}
+		if (auto ref = dyn_cast<DeclRefExpr>(stmt)) {
+			auto var = dyn_cast<VarDecl>(ref->getDecl());
+			// parameters of `function` aren't constants, those of a
+			// lambda in it are fine
+			if (isa_and_nonnull<ParmVarDecl>(var) &&
+			    var->getDeclContext() == function) {
+				return false;
+			}
+			if (var && var->getCanonicalDecl() != table &&
+			    !var->isLocalVarDeclOrParm() &&
+			    !var->isUsableInConstantExpressions(*context)) {
+				return false;
+			}
+		}
+		if (auto call = dyn_cast<CallExpr>(stmt)) {
+			auto callee = call->getDirectCallee();
+			if (!callee || !callee->isConstexpr()) {
+				return false;
+			}
+		}
+		if (auto construct = dyn_cast<CXXConstructExpr>(stmt)) {
+			auto ctor = construct->getConstructor();
+			if (!ctor->isConstexpr() && !ctor->isTrivial()) {
+				return false;
+			}
+		}
+		for (auto child : stmt->children()) {
+			if (child &&
+			    !isConstantEvaluable(child, function, table)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+	// The only function writing the table, if it writes it in loops
+	// and nothing else can write it
+	const FunctionDecl *generator(const std::vector<DeclRefExpr *> &refs) {
+		const FunctionDecl *writer = nullptr;
+		for (auto ref : refs) {
+			auto access = accessOf(ref);
+			if (access == Access::Escape) {
+				return nullptr;
+			}
+			if (access == Access::Read) {
+				continue;
+			}
+			bool inLoop;
+			auto function = enclosingFunction(ref, inLoop);
+			if (!function || !inLoop ||
+			    (writer && writer != function)) {
+				return nullptr;
+			}
+			writer = function;
+		}
+		return writer;
+	}
+
+      public:
+	StartupTablePass(ASTContext *context, DiagnosticsEngine &d,
+	                 GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		tableWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 is filled at startup by %1, it could be generated at "
+		    "compile time");
+		generatorNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "make %0 a constexpr function returning the table, e.g. a "
+		    "std::array, and initialize a constexpr %1 with it; the "
+		    "table moves to read-only data");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		auto type = decl->getType();
+		// filling a std::array in a constexpr function needs C++17,
+		// and other units could write a table with external linkage
+		if (!context->getLangOpts().CPlusPlus17 ||
+		    !type->isConstantArrayType() || type.isConstQualified() ||
+		    decl->isExternallyVisible() || hasSideEffectInit(decl) ||
+		    !context->getBaseElementType(type)->isLiteralType(
+		        *context)) {
+			return;
+		}
+		track(decl);
+	}
+
+	void finish() override {
+		forEachTracked([&](VarDecl *vdecl,
+		                   std::vector<DeclRefExpr *> &refs) {
+			auto function = generator(refs);
+			if (!function || !function->hasBody() ||
+			    !isConstantEvaluable(function->getBody(), function,
+			                         vdecl)) {
+				return;
+			}
+			d.Report(context->getFullLoc(vdecl->getLocation()),
+			         tableWarning)
+			    << vdecl << function;
+			d.Report(context->getFullLoc(function->getLocation()),
+			         generatorNote)
+			    << function << vdecl;
+		});
+	}
+};
+
+// Global std::map, std::set and unordered ones that are filled once and
+// then only queried. Every element is a node allocation, and lookups
+// chase pointers; a sorted array or a perfect hash table is smaller and
+// built at compile time.
+class FrozenContainerPass : public GlobalAnalysisPass {
+      private:
+	unsigned int frozenWarning, layoutNote;
+	// tree based containers, the others are hash tables
+	llvm::DenseSet<VarDecl *> trees;
+
+	// Lookups on a non const container pick the non const overloads,
+	// so member calls are judged by name. Those returning elements
+	// are only reads if nothing is written through the result.
+	static bool isReadOnlyMethod(StringRef name) {
+		return llvm::StringSwitch<bool>(name)
+		    .Cases("find", "count", "contains", "at", "size", "empty",
+		           true)
+		    .Cases("begin", "end", "cbegin", "cend", "rbegin", "rend",
+		           true)
+		    .Cases("lower_bound", "upper_bound", "equal_range",
+		           "max_size", true)
+		    .Cases("bucket", "bucket_count", "bucket_size",
+		           "load_factor", true)
+		    .Default(false);
+	}
+
+	static bool returnsElements(StringRef name) {
+		return llvm::StringSwitch<bool>(name)
+		    .Cases("find", "at", "begin", "end", "rbegin", "rend", true)
+		    .Cases("lower_bound", "upper_bound", "equal_range", true)
+		    .Default(false);
+	}
+
+	static void findReferences(const Stmt *stmt, const VarDecl *var,
+	                           std::vector<const DeclRefExpr *> &refs) {
+		auto ref = dyn_cast<DeclRefExpr>(stmt);
+		if (ref && ref->getDecl() == var) {
+			refs.push_back(ref);
+		}
+		for (auto child : stmt->children()) {
+			if (child) {
+				findReferences(child, var, refs);
+			}
+		}
+	}
+
+	// Whether an element may be written through `e`, an iterator or a
+	// pair of iterators. Local variables holding them are followed to
+	// their uses.
+	bool writesThrough(const Expr *e, unsigned depth = 0) {
+		if (depth > 4) {
+			return true;
+		}
+		while (true) {
+			auto parents = context->getParents(*e);
+			if (parents.empty()) {
+				return false;
+			}
+			auto parent = parents[0].get<Expr>();
+			if (!parent) {
+				auto var = parents[0].get<VarDecl>();
+				if (!var) {
+					// returned, or the value is discarded
+					return parents[0].get<ReturnStmt>() !=
+					       nullptr;
+				}
+				auto owner = var->getDeclContext();
+				auto function = dyn_cast<FunctionDecl>(owner);
+				if (!function || !function->hasBody()) {
+					return true;
+				}
+				std::vector<const DeclRefExpr *> refs;
+				findReferences(function->getBody(), var, refs);
+				for (auto ref : refs) {
+					if (writesThrough(ref, depth + 1)) {
+						return true;
+					}
+				}
+				return false;
+			}
+			if (auto call = dyn_cast<CXXOperatorCallExpr>(parent)) {
+				switch (call->getOperator()) {
+				case OO_EqualEqual:
+				case OO_ExclaimEqual:
+				case OO_PlusPlus:
+				case OO_MinusMinus:
+					return false;
+				case OO_Equal:
+					// assigned to, rather than assigned
+					return call->getArg(0) != e;
+				case OO_Star:
+					return accessOf(call) != Access::Read;
+				case OO_Arrow: {
+					auto up = context->getParents(*call);
+					auto arrow =
+					    up.empty() ? nullptr
+					               : up[0].get<MemberExpr>();
+					return !arrow ||
+					       accessOf(arrow) != Access::Read;
+				}
+				default:
+					return true;
+				}
+			}
+			auto member = dyn_cast<MemberExpr>(parent);
+			// `first` and `second` of equal_range()
+			if (member && !isa<FieldDecl>(member->getMemberDecl())) {
+				return true;
+			}
+			// copies of the iterator
+			auto construct = dyn_cast<CXXConstructExpr>(parent);
+			if (construct && construct->getNumArgs() == 1) {
+				e = parent;
+				continue;
+			}
+			if (!member && !isa<ParenExpr>(parent) &&
+			    !isa<ImplicitCastExpr>(parent) &&
+			    !isa<MaterializeTemporaryExpr>(parent) &&
+			    !isa<CXXBindTemporaryExpr>(parent) &&
+			    !isa<FullExpr>(parent)) {
+				return true;
+			}
+			e = parent;
+		}
+	}
+
+	// The range of a range based for loop is only read if the loop
+	// variable is a copy, a const reference or isn't modified
+	bool isRangeWritten(const VarDecl *range) {
+		auto parents = context->getParents(*range);
+		auto declStmt =
+		    parents.empty() ? nullptr : parents[0].get<DeclStmt>();
+		if (declStmt) {
+			parents = context->getParents(*declStmt);
+		}
+		auto loop = !declStmt || parents.empty()
+		                ? nullptr
+		                : parents[0].get<CXXForRangeStmt>();
+		if (!loop) {
+			return true;
+		}
+		auto var = loop->getLoopVariable();
+		auto type = var->getType();
+		if (!type->isReferenceType() ||
+		    type->getPointeeType().isConstQualified()) {
+			return false;
+		}
+		ExprMutationAnalyzer analyzer(*loop->getBody(), *context);
+		return analyzer.isMutated(var);
+	}
+
+	// The node using `e` past parentheses and implicit casts, `e` is
+	// moved up to the expression it uses
+	DynTypedNode userOf(const Expr *&e) {
+		auto parents = context->getParents(*e);
+		while (!parents.empty() && parents[0].get<Expr>() &&
+		       (isa<ParenExpr>(parents[0].get<Expr>()) ||
+		        isa<ImplicitCastExpr>(parents[0].get<Expr>()))) {
+			e = parents[0].get<Expr>();
+			parents = context->getParents(*e);
+		}
+		return parents.empty() ? DynTypedNode() : parents[0];
+	}
+
+	// Mutations that only add elements, as a function filling the
+	// container does
+	bool isInsertion(DeclRefExpr *ref) {
+		const Expr *e = ref;
+		auto user = userOf(e);
+		auto member = user.get<MemberExpr>();
+		if (member) {
+			auto name = member->getMemberDecl()->getIdentifier();
+			return name && llvm::StringSwitch<bool>(name->getName())
+			    .Cases("insert", "emplace", "emplace_hint", true)
+			    .Cases("try_emplace", "insert_or_assign", true)
+			    .Default(false);
+		}
+		auto call = user.get<CXXOperatorCallExpr>();
+		return call && call->getArg(0) == e &&
+		       call->getOperator() == OO_Subscript;
+	}
+
+	bool isMutation(DeclRefExpr *ref) {
+		const Expr *e = ref;
+		auto user = userOf(e);
+		auto var = user.get<VarDecl>();
+		if (var && var->isImplicit()) {
+			return isRangeWritten(var);
+		}
+		auto member = user.get<MemberExpr>();
+		if (member && isa<CXXMethodDecl>(member->getMemberDecl())) {
+			auto name = member->getMemberDecl()->getName();
+			if (!isReadOnlyMethod(name)) {
+				return true;
+			}
+			auto up = context->getParents(*member);
+			auto call = up.empty() ? nullptr
+			                       : up[0].get<CXXMemberCallExpr>();
+			if (!returnsElements(name)) {
+				return false;
+			}
+			if (!call) {
+				return true;
+			}
+			// at() returns a reference to the element
+			return call->isLValue() ? accessOf(call) != Access::Read
+			                        : writesThrough(call);
+		}
+		auto call = user.get<CXXOperatorCallExpr>();
+		if (call && call->getArg(0) == e) {
+			// operator[] inserts, operator= replaces
+			return call->getOperator() == OO_Subscript ||
+			       call->isAssignmentOp();
+		}
+		return accessOf(ref) != Access::Read;
+	}
+
+	// References to a function, to find where it is called
+	struct FunctionReferences
+	    : RecursiveASTVisitor<FunctionReferences> {
+		const FunctionDecl *function;
+		std::vector<const DeclRefExpr *> refs;
+
+		bool VisitDeclRefExpr(DeclRefExpr *ref) {
+			auto decl = ref->getDecl()->getCanonicalDecl();
+			if (decl == function->getCanonicalDecl()) {
+				refs.push_back(ref);
+			}
+			return true;
+		}
+	};
+
+	// Whether `filler` runs once before the container is read: it is
+	// only called, outside loops, from functions not using the
+	// container themselves. Callers in other units aren't known.
+	bool fillsOnce(const FunctionDecl *filler,
+	               const std::vector<DeclRefExpr *> &uses) {
+		// calls to methods aren't DeclRefExprs
+		if (filler->isExternallyVisible() ||
+		    isa<CXXMethodDecl>(filler)) {
+			return false;
+		}
+		FunctionReferences finder;
+		finder.function = filler;
+		finder.TraverseDecl(context->getTranslationUnitDecl());
+		for (auto ref : finder.refs) {
+			// the callee, not a pointer to the function
+			const Expr *e = ref;
+			auto call = userOf(e).get<CallExpr>();
+			if (!call || call->getCallee()->IgnoreParenImpCasts() !=
+			                 ref) {
+				return false;
+			}
+			bool inLoop;
+			auto caller = enclosingFunction(call, inLoop);
+			if (!caller || inLoop) {
+				return false;
+			}
+			for (auto use : uses) {
+				if (enclosingFunction(use, inLoop) == caller) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+	// Number of elements of a `{...}` initializer, 0 if unknown
+	static unsigned initialElements(const VarDecl *decl) {
+		auto init = decl->getInit();
+		auto construct =
+		    init ? dyn_cast<CXXConstructExpr>(init->IgnoreImplicit())
+		         : nullptr;
+		if (!construct || construct->getNumArgs() == 0) {
+			return 0;
+		}
+		auto arg = construct->getArg(0)->IgnoreImplicit();
+		if (auto list = dyn_cast<CXXStdInitializerListExpr>(arg)) {
+			arg = list->getSubExpr()->IgnoreImplicit();
+		}
+		auto list = dyn_cast<InitListExpr>(arg);
+		return list ? list->getNumInits() : 0;
+	}
+
+	// whether the key, and the mapped type of a map, are literal types
+	bool hasLiteralElements(const VarDecl *decl) {
+		auto specialization = dyn_cast<ClassTemplateSpecializationDecl>(
+		    decl->getType()->getAsCXXRecordDecl());
+		if (!specialization) {
+			return false;
+		}
+		auto &args = specialization->getTemplateArgs();
+		for (unsigned i = 0; i < args.size() && i < 2; i++) {
+			if (args[i].getKind() != TemplateArgument::Type ||
+			    !args[i].getAsType()->isLiteralType(*context)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+      public:
+	FrozenContainerPass(ASTContext *context, DiagnosticsEngine &d,
+	                    GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		frozenWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 is only read after %select{its initialization|%2 fills "
+		    "it}1");
+		layoutNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "a %select{sorted constexpr array|flat map (a sorted "
+		    "vector)|perfect hash table or a sorted array}0 would save "
+		    "about %1 bytes per element%select{| (%3 bytes for %4 "
+		    "elements)}2");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		auto record = decl->getType()->getAsCXXRecordDecl();
+		// other units could modify one with external linkage
+		if (!record || !record->isInStdNamespace() ||
+		    decl->isExternallyVisible()) {
+			return;
+		}
+		auto name = record->getName();
+		bool ordered = name == "map" || name == "set" ||
+		               name == "multimap" || name == "multiset";
+		if (ordered || name == "unordered_map" ||
+		    name == "unordered_set" || name == "unordered_multimap" ||
+		    name == "unordered_multiset") {
+			track(decl);
+		}
+		if (ordered) {
+			trees.insert(decl);
+		}
+	}
+
+	void finish() override {
+		// per element, beyond the element itself (libstdc++): a tree
+		// node has a color and 3 pointers, a hash node a next pointer,
+		// the cached hash and a bucket; and each node is a malloc block
+		uint64_t pointer = context->getTypeSize(context->VoidPtrTy) / 8;
+		uint64_t treeNode = 6 * pointer, hashNode = 5 * pointer;
+
+		forEachTracked([&](VarDecl *vdecl,
+		                   std::vector<DeclRefExpr *> &refs) {
+			// filled in the initializer, or by insertions in one
+			// function without parameters, e.g. an init() called
+			// once at startup
+			const FunctionDecl *filler = nullptr;
+			bool frozen = true;
+			for (auto ref : refs) {
+				if (!isMutation(ref)) {
+					continue;
+				}
+				bool inLoop;
+				auto function = enclosingFunction(ref, inLoop);
+				if (!isInsertion(ref) || !function ||
+				    function->getNumParams() > 0 ||
+				    (filler && filler != function)) {
+					frozen = false;
+					break;
+				}
+				filler = function;
+			}
+			if (!frozen || (filler && !fillsOnce(filler, refs))) {
+				return;
+			}
+
+			const VarDecl *definition = vdecl->getDefinition();
+			if (!definition) {
+				return;
+			}
+			// a constexpr array needs literal elements, known at
+			// compile time
+			unsigned layout = 2;
+			bool tree = trees.count(vdecl);
+			if (tree) {
+				auto &lang = context->getLangOpts();
+				bool constant = !filler && lang.CPlusPlus14 &&
+				                hasLiteralElements(definition);
+				layout = constant ? 0 : 1;
+			}
+			auto saved = tree ? treeNode : hashNode;
+			auto elements = initialElements(definition);
+
+			auto loc =
+			    context->getFullLoc(definition->getLocation());
+			d.Report(loc, frozenWarning)
+			    << definition << (filler != nullptr) << filler;
+			d.Report(loc, layoutNote)
+			    << layout << (unsigned)saved << (elements > 0)
+			    << (unsigned)(saved * elements) << elements;
+		});
+	}
+};
+
+// Global arrays of structs whose loops only use some fields of each
+// element, as in `for (...) sum += particles[i].mass`. The loop still
+// loads whole elements into the cache; with a structure of arrays it
+// would only load the fields it uses.
+class StructOfArraysPass : public GlobalAnalysisPass {
+      private:
+	unsigned int soaWarning, loopNote;
+
+	// fields used by each loop, null for the whole element
+	using LoopFields =
+	    llvm::DenseMap<const Stmt *, llvm::SmallPtrSet<FieldDecl *, 4>>;
+	// bytes of each element used by a loop
+	using LoopUse = std::pair<uint64_t, const Stmt *>;
+
+	// The field in `array[i].field`, null if `ref` is used otherwise
+	FieldDecl *elementField(const DeclRefExpr *ref) {
+		const Expr *e = ref;
+		bool element = false;
+		while (true) {
+			auto parents = context->getParents(*e);
+			auto parent =
+			    parents.empty() ? nullptr : parents[0].get<Expr>();
+			if (!parent) {
+				return nullptr;
+			}
+			auto subscript = dyn_cast<ArraySubscriptExpr>(parent);
+			auto member = dyn_cast<MemberExpr>(parent);
+			if (subscript && subscript->getBase() == e) {
+				element = true;
+			} else if (member && element) {
+				auto field = member->getMemberDecl();
+				return dyn_cast<FieldDecl>(field);
+			} else if (!isa<ParenExpr>(parent) &&
+			           !isa<ImplicitCastExpr>(parent)) {
+				return nullptr;
+			}
+			e = parent;
+		}
+	}
+
+	uint64_t bytes(const FieldDecl *field) {
+		return context->getTypeSizeInChars(field->getType())
+		    .getQuantity();
+	}
+
+      public:
+	StructOfArraysPass(ASTContext *context, DiagnosticsEngine &d,
+	                   GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		soaWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 is an array of structs whose loops use as little as "
+		    "%1%% of each element, consider a structure of arrays");
+		loopNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "this loop uses %0 of the %1 bytes of each element: %2");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		auto type = decl->getType();
+		auto record =
+		    context->getBaseElementType(type)->getAsRecordDecl();
+		if (!type->isConstantArrayType() || !record ||
+		    record->isUnion() || decl->hasExternalStorage()) {
+			return;
+		}
+		// worth it once the array spans a few cache lines
+		if (context->getTypeSizeInChars(type).getQuantity() < 256) {
+			return;
+		}
+		track(decl);
+	}
+
+	void finish() override {
+		forEachTracked([&](VarDecl *vdecl,
+		                   std::vector<DeclRefExpr *> &refs) {
+			auto type = vdecl->getType();
+			auto element = context->getBaseElementType(type);
+			auto record = element->getAsRecordDecl();
+			uint64_t size =
+			    context->getTypeSizeInChars(element).getQuantity();
+			LoopFields loops;
+			for (auto ref : refs) {
+				if (auto loop = innermostLoop(ref)) {
+					loops[loop].insert(elementField(ref));
+				}
+			}
+
+			// loops using part of each element, and the bytes used
+			std::vector<LoopUse> partial;
+			for (auto &loop : loops) {
+				if (loop.second.count(nullptr)) {
+					continue;
+				}
+				uint64_t used = 0;
+				for (auto field : loop.second) {
+					used += bytes(field);
+				}
+				// at most half of each element
+				if (used * 2 <= size) {
+					partial.push_back({used, loop.first});
+				}
+			}
+			if (partial.empty()) {
+				return;
+			}
+			auto &sm = context->getSourceManager();
+			std::sort(partial.begin(), partial.end(),
+			          [&](const LoopUse &a, const LoopUse &b) {
+				          return sm.isBeforeInTranslationUnit(
+				              a.second->getBeginLoc(),
+				              b.second->getBeginLoc());
+			          });
+			uint64_t least = size;
+			for (auto &loop : partial) {
+				least = std::min(least, loop.first);
+			}
+			d.Report(context->getFullLoc(vdecl->getLocation()),
+			         soaWarning)
+			    << vdecl << (unsigned)(100 * least / size);
+			for (auto &loop : partial) {
+				// fields in declaration order
+				std::string names;
+				auto &used = loops[loop.second];
+				for (auto field : record->fields()) {
+					if (!used.count(field)) {
+						continue;
+					}
+					if (!names.empty()) {
+						names += ", ";
+					}
+					names += field->getName().str();
+				}
+				d.Report(context->getFullLoc(
+				             loop.second->getBeginLoc()),
+				         loopNote)
+				    << (unsigned)loop.first << (unsigned)size
+				    << names;
+			}
+		});
+	}
+};
+
+// Global structs, and arrays of them, that lose memory to padding
+// between fields that a different field order would avoid.
+class PaddingPass : public GlobalAnalysisPass {
+      private:
+	unsigned int paddingWarning, orderNote;
+
+	struct Waste {
+		VarDecl *decl;
+		const RecordDecl *record;
+		uint64_t elements, padding, size, packedSize;
+		std::vector<const FieldDecl *> order;
+	};
+
+	uint64_t bytes(QualType type) {
+		return context->getTypeSizeInChars(type).getQuantity();
+	}
+
+	// Fields by decreasing alignment, which leaves no padding between
+	// fields whose sizes are multiples of their alignment.
+	uint64_t reorder(const RecordDecl *record,
+	                 std::vector<const FieldDecl *> &order) {
+		for (auto field : record->fields()) {
+			order.push_back(field);
+		}
+		std::stable_sort(order.begin(), order.end(),
+		                 [&](const FieldDecl *a, const FieldDecl *b) {
+			                 return context->getDeclAlign(a) >
+			                        context->getDeclAlign(b);
+		                 });
+		uint64_t offset = 0, align = 1;
+		for (auto field : order) {
+			uint64_t fieldAlign =
+			    context->getDeclAlign(field).getQuantity();
+			offset = llvm::alignTo(offset, fieldAlign) +
+			         bytes(field->getType());
+			align = std::max(align, fieldAlign);
+		}
+		auto &layout = context->getASTRecordLayout(record);
+		align = std::max<uint64_t>(align,
+		                           layout.getAlignment().getQuantity());
+		return llvm::alignTo(offset, align);
+	}
+
+	// Records whose layout only depends on the order of their fields,
+	// and that the user can change: not those of system headers
+	bool isReorderable(const RecordDecl *record) {
+		auto cxx = dyn_cast<CXXRecordDecl>(record);
+		auto &sm = context->getSourceManager();
+		if (sm.isInSystemHeader(record->getLocation()) ||
+		    record->isUnion() || record->hasFlexibleArrayMember() ||
+		    record->hasAttr<PackedAttr>() || record->isInvalidDecl() ||
+		    (cxx && (cxx->getNumBases() || cxx->getNumVBases() ||
+		             cxx->isDynamicClass()))) {
+			return false;
+		}
+		for (auto field : record->fields()) {
+			if (field->isBitField() || field->isZeroSize(*context)) {
+				return false;
+			}
+		}
+		return true;
+	}
+
+      public:
+	PaddingPass(ASTContext *context, DiagnosticsEngine &d,
+	            GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		paddingWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 wastes %1 bytes on padding, %2 in each of its %3 "
+		    "%plural{1:element|:elements}3");
+		orderNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "ordering the fields of %0 as %1 makes it %2 bytes instead "
+		    "of %3");
+	}
+
+	void finish() override {
+		std::vector<Waste> wastes;
+		llvm::DenseSet<VarDecl *> seen;
+		for (auto vdecl : table.globals) {
+			if (!seen.insert(vdecl).second || isRcsIgnore(vdecl) ||
+			    !isReportable(vdecl)) {
+				continue;
+			}
+			auto type = vdecl->getType();
+			auto element = context->getBaseElementType(type);
+			auto record = element->getAsRecordDecl();
+			if (type->isDependentType() ||
+			    type->isIncompleteType() || !record ||
+			    !isReorderable(record) || !bytes(element)) {
+				continue;
+			}
+			Waste waste{vdecl, record};
+			waste.size = bytes(element);
+			waste.elements = bytes(type) / waste.size;
+			uint64_t fields = 0;
+			for (auto field : record->fields()) {
+				fields += bytes(field->getType());
+			}
+			waste.padding = waste.size - fields;
+			waste.packedSize = reorder(record, waste.order);
+			// only what a field order saves, over at least a cache
+			// line
+			auto saved = waste.size - waste.packedSize;
+			if (waste.packedSize >= waste.size ||
+			    saved * waste.elements < 64) {
+				continue;
+			}
+			wastes.push_back(std::move(waste));
+		}
+		std::stable_sort(wastes.begin(), wastes.end(),
+		                 [](const Waste &a, const Waste &b) {
+			                 return a.padding * a.elements >
+			                        b.padding * b.elements;
+		                 });
+		for (auto &waste : wastes) {
+			std::string order;
+			for (auto field : waste.order) {
+				order += order.empty() ? "" : ", ";
+				order += field->getName().str();
+			}
+			auto total = waste.padding * waste.elements;
+			d.Report(context->getFullLoc(waste.decl->getLocation()),
+			         paddingWarning)
+			    << waste.decl << (unsigned)total
+			    << (unsigned)waste.padding
+			    << (unsigned)waste.elements;
+			auto recordLoc = waste.record->getLocation();
+			d.Report(context->getFullLoc(recordLoc), orderNote)
+			    << waste.record << order
+			    << (unsigned)waste.packedSize
+			    << (unsigned)waste.size;
+		}
+	}
+};
+
+// Copies of large globals, or of globals that own memory like
+// containers: passed by value, or used to initialize a local where a
+// reference would do. Each one copies the object on every call.
+class LargeCopyPass : public GlobalAnalysisPass {
+      private:
+	unsigned int copyWarning, referenceNote, pointerNote;
+	uint64_t minimumSize;
+
+	// The copy of the global `ref` names, if it is copied
+	const Expr *copyOf(const DeclRefExpr *ref) {
+		const Expr *e = ref;
+		while (true) {
+			auto parents = context->getParents(*e);
+			auto parent =
+			    parents.empty() ? nullptr : parents[0].get<Expr>();
+			if (!parent) {
+				return nullptr;
+			}
+			auto construct = dyn_cast<CXXConstructExpr>(parent);
+			if (construct) {
+				auto ctor = construct->getConstructor();
+				bool copy = ctor->isCopyConstructor() &&
+				            construct->getArg(0) == e;
+				return copy ? construct : nullptr;
+			}
+			auto cast = dyn_cast<ImplicitCastExpr>(parent);
+			// C copies a struct by reading its value
+			if (cast && cast->getCastKind() == CK_LValueToRValue) {
+				return cast;
+			}
+			if (!cast && !isa<ParenExpr>(parent)) {
+				return nullptr;
+			}
+			e = parent;
+		}
+	}
+
+	// What the copy is for: 0 an argument, 1 a variable (`var`), 2 else
+	unsigned copyKind(const Expr *copy, const VarDecl *&var) {
+		const Expr *e = copy;
+		while (true) {
+			auto parents = context->getParents(*e);
+			if (parents.empty()) {
+				return 2;
+			}
+			if ((var = parents[0].get<VarDecl>())) {
+				return 1;
+			}
+			auto parent = parents[0].get<Expr>();
+			if (isa_and_nonnull<CallExpr>(parent) ||
+			    isa_and_nonnull<CXXConstructExpr>(parent)) {
+				return 0;
+			}
+			if (!parent || !(isa<MaterializeTemporaryExpr>(parent) ||
+			                 isa<CXXBindTemporaryExpr>(parent) ||
+			                 isa<ImplicitCastExpr>(parent) ||
+			                 isa<FullExpr>(parent))) {
+				return 2;
+			}
+			e = parent;
+		}
+	}
+
+      public:
+	LargeCopyPass(ASTContext *context, DiagnosticsEngine &d,
+	              GlobalTable &table, uint64_t minimumSize)
+	    : GlobalAnalysisPass(context, d, table), minimumSize(minimumSize) {
+		copyWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "%0 is copied%select{| in a loop}1 (%2 bytes%select{|, and "
+		    "what it owns}3)");
+		referenceNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "%select{take the parameter by const reference|bind a "
+		    "reference instead: 'const auto &%1 = ...'|use a const "
+		    "reference}0");
+		pointerNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "%select{take a '%2 *' parameter instead|point to it "
+		    "instead: '%2 *%1 = &...'|use a '%2 *' pointer}0");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		auto type = decl->getType();
+		if (!type->isRecordType() || type->isDependentType() ||
+		    type->isIncompleteType()) {
+			return;
+		}
+		// what an object owns is unknown, only its own size counts
+		if (context->getTypeSizeInChars(type).getQuantity() >=
+		    (int64_t)minimumSize) {
+			track(decl);
+		}
+	}
+
+	void finish() override {
+		forEachTracked([&](VarDecl *vdecl,
+		                   std::vector<DeclRefExpr *> &refs) {
+			auto type = vdecl->getType();
+			auto record = type->getAsCXXRecordDecl();
+			bool owns =
+			    record && record->hasNonTrivialCopyConstructor();
+			auto size =
+			    context->getTypeSizeInChars(type).getQuantity();
+			// C has no references, a pointer to const does
+			auto pointee = type.withConst().getAsString(
+			    context->getPrintingPolicy());
+			for (auto ref : refs) {
+				auto copy = copyOf(ref);
+				if (!copy || (!changeSet().empty() &&
+				              !isChanged(ref->getLocation()))) {
+					continue;
+				}
+				bool inLoop;
+				enclosingFunction(copy, inLoop);
+				const VarDecl *var = nullptr;
+				auto kind = copyKind(copy, var);
+				auto loc =
+				    context->getFullLoc(ref->getLocation());
+				d.Report(loc, copyWarning)
+				    << vdecl << inLoop << (unsigned)size << owns;
+				auto name = var ? var->getName() : "";
+				if (context->getLangOpts().CPlusPlus) {
+					d.Report(loc, referenceNote)
+					    << kind << name;
+				} else {
+					d.Report(loc, pointerNote)
+					    << kind << name << pointee;
+				}
+			}
+		});
+	}
+};
+
+// volatile globals used in loops. Every access goes to memory, where a
+// flag polled by the loop only needs an atomic load and an accumulator
+// a local that is stored once after the loop.
+class VolatileLoopPass : public GlobalAnalysisPass {
+      private:
+	unsigned int volatileWarning, pollNote, accumulateNote, escapeNote;
+
+	struct LoopAccess {
+		const Stmt *loop;
+		unsigned reads = 0, writes = 0, escapes = 0;
+	};
+
+      public:
+	VolatileLoopPass(ASTContext *context, DiagnosticsEngine &d,
+	                 GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {
+		volatileWarning = d.getCustomDiagID(
+		    DiagnosticsEngine::Warning,
+		    "volatile %0 is accessed in %1 %plural{1:loop|:loops}1");
+		pollNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "%0 %plural{1:read|:reads}0 in the loop: if it is a flag "
+		    "set by another thread, make it %select{an _Atomic|a "
+		    "std::atomic}1 and load it with relaxed ordering");
+		accumulateNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "%0 %plural{1:access|:accesses}0 in the loop, %1 of them "
+		    "%plural{1:a write|:writes}1: accumulate in a local and "
+		    "store it once after the loop");
+		escapeNote = d.getCustomDiagID(
+		    DiagnosticsEngine::Note,
+		    "%0 %plural{1:access|:accesses}0 in the loop, and its "
+		    "address is passed on there: accesses through it go to "
+		    "memory too");
+	}
+
+	void onGlobal(VarDecl *decl) override {
+		auto type = decl->getType();
+		if (!context->getBaseElementType(type).isVolatileQualified()) {
+			return;
+		}
+		// the type meant for flags set by signal handlers
+		auto typedefType = type->getAs<TypedefType>();
+		if (typedefType &&
+		    typedefType->getDecl()->getName() == "sig_atomic_t") {
+			return;
+		}
+		track(decl);
+	}
+
+	void finish() override {
+		forEachTracked([&](VarDecl *vdecl,
+		                   std::vector<DeclRefExpr *> &refs) {
+			// accesses by innermost loop, in source order
+			std::vector<LoopAccess> loops;
+			for (auto ref : refs) {
+				auto loop = innermostLoop(ref);
+				if (!loop) {
+					continue;
+				}
+				auto access = std::find_if(
+				    loops.begin(), loops.end(),
+				    [&](const LoopAccess &a) {
+					    return a.loop == loop;
+				    });
+				if (access == loops.end()) {
+					loops.push_back({loop});
+					access = loops.end() - 1;
+				}
+				switch (accessOf(ref)) {
+				case Access::Read:
+					access->reads++;
+					break;
+				case Access::Escape:
+					access->escapes++;
+					break;
+				default:
+					access->writes++;
+				}
+			}
+			if (loops.empty()) {
+				return;
+			}
+			d.Report(context->getFullLoc(vdecl->getLocation()),
+			         volatileWarning)
+			    << vdecl << (unsigned)loops.size();
+			for (auto &access : loops) {
+				auto loopLoc = access.loop->getBeginLoc();
+				auto loc = context->getFullLoc(loopLoc);
+				auto total = access.reads + access.writes;
+				total += access.escapes;
+				if (access.escapes) {
+					d.Report(loc, escapeNote) << total;
+				} else if (access.writes) {
+					d.Report(loc, accumulateNote)
+					    << total << access.writes;
+				} else {
+					d.Report(loc, pollNote)
+					    << access.reads
+					    << context->getLangOpts().CPlusPlus;
+				}
+			}
+		});
+	}
+};
+
+// What the traversal reports to the passes. With -jobs the traversal of
+// top level decls is split over threads which only record these, and the
+// main thread replays them in source order.
+struct TraversalEvent {
+	enum Kind { Global, Reference, ScopeEnter, ScopeExit, Local } kind;
+	// Global, Local: the VarDecl as visited, Reference: the canonical
+	// VarDecl
+	VarDecl *decl;
+	DeclRefExpr *ref;
+	// the innermost block, or the block being entered / left
+	CompoundStmt *scope;
+	CompoundStmt *parent;
+	// ScopeEnter, Local: loops around the block or the local
+	unsigned loopDepth = 0;
+};
+
+std::function<void(const GlobalSummary &)> globalSummaryHook;
+
+void setGlobalSummaryHook(std::function<void(const GlobalSummary &)> hook) {
+	globalSummaryHook = std::move(hook);
+}
+
+// Reports every global with external linkage used or defined in this TU
+// to the driver, which finds the ones no other TU uses.
+class SummaryPass : public GlobalAnalysisPass {
+      private:
+	std::unique_ptr<MangleContext> mangler;
+	llvm::DenseMap<VarDecl *, unsigned> externalReferences;
+
+	std::string linkageName(VarDecl *decl) {
+		if (!mangler->shouldMangleDeclName(decl)) {
+			return decl->getName().str();
+		}
+		std::string name;
+		llvm::raw_string_ostream os(name);
+		mangler->mangleName(decl, os);
+		return os.str();
+	}
+
+	static unsigned countUses(const std::vector<UsageInformation> &uses) {
+		unsigned count = 0;
+		for (auto &use : uses) {
+			count += use.children.empty() ? 1 : countUses(use.children);
+		}
+		return count;
+	}
+
+	void report(VarDecl *decl, unsigned references) {
+		auto location = context->getSourceManager().getPresumedLoc(
+		    decl->getLocation());
+		GlobalSummary summary;
+		summary.name = decl->getQualifiedNameAsString();
+		summary.symbolHash = llvm::xxHash64(linkageName(decl));
+		if (location.isValid()) {
+			summary.location = std::string(location.getFilename()) +
+			                   ":" + std::to_string(location.getLine());
+		}
+		// an importer sees the definition of a module's global too, but
+		// only the module's interface unit defines it
+		auto definition = decl->getDefinition();
+		if (!definition)
+			definition = decl->getActingDefinition();
+		summary.defined = definition && !definition->isFromASTFile();
+		summary.references = references;
+		if (auto module = decl->getOwningModule()) {
+			summary.module = module->getTopLevelModuleName().str();
+			for (auto redecl : decl->redecls())
+				summary.exported |= isExported(redecl);
+		}
+		globalSummaryHook(summary);
+	}
+
+      public:
+	SummaryPass(ASTContext *context, DiagnosticsEngine &d, GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table),
+	      mangler(context->createMangleContext()) {}
+
+	void onExternalReference(VarDecl *decl, DeclRefExpr *ref) override {
+		externalReferences[decl]++;
+	}
+
+	void finish() override {
+		for (auto vdecl : table.globals) {
+			if (vdecl->isExternallyVisible()) {
+				report(vdecl, countUses(table.usages[vdecl]));
+			}
+		}
+		for (auto &entry : externalReferences) {
+			if (!table.isTracked(entry.first)) {
+				report(entry.first, entry.second);
+			}
+		}
+	}
+};
+
+std::function<void(const HeaderGlobalSummary &)> headerGlobalHook;
+
+void setHeaderGlobalHook(
+    std::function<void(const HeaderGlobalSummary &)> hook) {
+	headerGlobalHook = std::move(hook);
+}
+
+// The part of the header global analysis that only depends on the header.
+struct HeaderSummary {
+	struct Global {
+		std::string name;
+		unsigned line;
+	};
+	std::vector<Global> globals;
+	// (declaring header, qualified name) of the header globals used by
+	// code in this header
+	std::vector<std::pair<std::string, std::string>> uses;
+};
+
+// Header summaries shared by all TUs of the process, and by all processes
+// of a build with -header-cache. On disk, one file per header, named after
+// the hash of its path, contents and the macros it depends on, little
+// endian:
+//
+//   "RCSH0002"
+//   u32 n, n x (str name, u32 line)       globals
+//   u32 n, n x (str header, str name)     uses
+//
+// where str is a u32 length followed by the bytes.
+class HeaderCache {
+      private:
+	std::mutex lock;
+	std::unordered_map<uint64_t, std::shared_ptr<const HeaderSummary>>
+	    summaries;
+	std::string directory;
+
+	std::string pathOf(uint64_t key) {
+		char name[24];
+		snprintf(name, sizeof(name), "%016llx.rcsh",
+		         (unsigned long long)key);
+		llvm::SmallString<256> path(directory);
+		llvm::sys::path::append(path, name);
+		return path.str().str();
+	}
+
+	static void writeString(llvm::raw_ostream &os, llvm::StringRef str) {
+		llvm::support::endian::write<uint32_t>(os, str.size(),
+		                                       llvm::support::little);
+		os << str;
+	}
+
+	std::shared_ptr<HeaderSummary> load(uint64_t key) {
+		auto buffer = llvm::MemoryBuffer::getFile(pathOf(key));
+		if (!buffer)
+			return nullptr;
+		auto data = (*buffer)->getBuffer();
+		bool ok = data.consume_front("RCSH0002");
+		auto read32 = [&]() -> uint32_t {
+			if (data.size() < 4) {
+				ok = false;
+				return 0;
+			}
+			auto value = llvm::support::endian::read<
+			    uint32_t, llvm::support::little, 1>(data.data());
+			data = data.drop_front(4);
+			return value;
+		};
+		auto readString = [&]() -> std::string {
+			auto size = read32();
+			if (data.size() < size) {
+				ok = false;
+				return "";
+			}
+			auto str = data.take_front(size).str();
+			data = data.drop_front(size);
+			return str;
+		};
+		auto summary = std::make_shared<HeaderSummary>();
+		for (uint32_t n = read32(); ok && n > 0; n--) {
+			auto name = readString();
+			summary->globals.push_back({name, read32()});
+		}
+		for (uint32_t n = read32(); ok && n > 0; n--) {
+			auto header = readString();
+			summary->uses.push_back({header, readString()});
+		}
+		return ok ? summary : nullptr;
+	}
+
+	// written to a unique file and renamed, processes racing on the same
+	// header write the same contents
+	void save(uint64_t key, const HeaderSummary &summary) {
+		int fd;
+		llvm::SmallString<256> tmp;
+		if (llvm::sys::fs::createUniqueFile(pathOf(key) + ".%%%%%%%%",
+		                                    fd, tmp))
+			return;
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			os << "RCSH0002";
+			llvm::support::endian::write<uint32_t>(
+			    os, summary.globals.size(), llvm::support::little);
+			for (auto &global : summary.globals) {
+				writeString(os, global.name);
+				llvm::support::endian::write<uint32_t>(
+				    os, global.line, llvm::support::little);
+			}
+			llvm::support::endian::write<uint32_t>(
+			    os, summary.uses.size(), llvm::support::little);
+			for (auto &use : summary.uses) {
+				writeString(os, use.first);
+				writeString(os, use.second);
+			}
+			if (os.has_error()) {
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return;
+			}
+		}
+		if (llvm::sys::fs::rename(tmp, pathOf(key)))
+			llvm::sys::fs::remove(tmp);
+	}
+
+      public:
+	void setDirectory(const std::string &path) { directory = path; }
+
+	// Returns the summary for `key`, or null if the header still has to
+	// be analyzed. `first` is set if this process hasn't seen it yet.
+	std::shared_ptr<const HeaderSummary> lookup(uint64_t key, bool &first) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			auto entry = summaries.find(key);
+			if (entry != summaries.end()) {
+				first = false;
+				return entry->second;
+			}
+		}
+		first = true;
+		if (directory.empty())
+			return nullptr;
+		auto summary = load(key);
+		if (summary) {
+			std::lock_guard<std::mutex> guard(lock);
+			summaries.emplace(key, summary);
+		}
+		return summary;
+	}
+
+	void store(uint64_t key, std::shared_ptr<const HeaderSummary> summary) {
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			summaries.emplace(key, summary);
+		}
+		if (!directory.empty())
+			save(key, *summary);
+	}
+};
+
+HeaderCache &headerCache() {
+	static HeaderCache cache;
+	return cache;
+}
+
+void setHeaderCacheDirectory(const std::string &directory) {
+	if (!directory.empty())
+		llvm::sys::fs::create_directories(directory);
+	headerCache().setDirectory(directory);
+}
+
+static thread_local unsigned headerCacheHits = 0;
+
+unsigned takeHeaderCacheHits() {
+	auto hits = headerCacheHits;
+	headerCacheHits = 0;
+	return hits;
+}
+
+// The macros each file of the TU depends on: those it expands or tests,
+// with the definition that reaches the file. A header's decls only depend
+// on its text and on these, so together they key its HeaderSummary.
+class MacroFingerprints : public PPCallbacks {
+      private:
+	Preprocessor &pp;
+	// file -> macro -> hash of its definition, 0 if it isn't defined
+	llvm::DenseMap<FileID, llvm::StringMap<uint64_t>> macros;
+	// files the preprocessor is done with
+	llvm::DenseSet<FileID> complete;
+
+	void note(SourceLocation loc, const Token &name,
+	          const MacroDefinition &definition) {
+		auto &sm = pp.getSourceManager();
+		auto &used = macros[sm.getFileID(sm.getExpansionLoc(loc))];
+		auto key = name.getIdentifierInfo()->getName();
+		if (used.count(key))
+			return;
+		uint64_t hash = 0;
+		if (auto info = definition.getMacroInfo()) {
+			hash = info->isBuiltinMacro()
+			           ? 1
+			           : llvm::xxHash64(Lexer::getSourceText(
+			                 CharSourceRange::getTokenRange(
+			                     info->getDefinitionLoc(),
+			                     info->getDefinitionEndLoc()),
+			                 sm, pp.getLangOpts()));
+		}
+		used[key] = hash;
+	}
+
+      public:
+	explicit MacroFingerprints(Preprocessor &pp) : pp(pp) {}
+
+	void MacroExpands(const Token &name, const MacroDefinition &definition,
+	                  SourceRange, const MacroArgs *) override {
+		note(name.getLocation(), name, definition);
+	}
+
+	void Defined(const Token &name, const MacroDefinition &definition,
+	             SourceRange) override {
+		note(name.getLocation(), name, definition);
+	}
+
+	void Ifdef(SourceLocation loc, const Token &name,
+	           const MacroDefinition &definition) override {
+		note(loc, name, definition);
+	}
+
+	void Ifndef(SourceLocation loc, const Token &name,
+	            const MacroDefinition &definition) override {
+		note(loc, name, definition);
+	}
+
+	void FileChanged(SourceLocation, FileChangeReason reason,
+	                 SrcMgr::CharacteristicKind, FileID previous) override {
+		if (reason == ExitFile)
+			complete.insert(previous);
+	}
+
+	// Hash of the macros `fid` depends on, false while it is still being
+	// preprocessed.
+	bool fingerprint(FileID fid, uint64_t &hash) const {
+		if (!complete.count(fid))
+			return false;
+		std::vector<std::pair<llvm::StringRef, uint64_t>> sorted;
+		auto entry = macros.find(fid);
+		if (entry != macros.end()) {
+			for (auto &macro : entry->second)
+				sorted.push_back({macro.first(), macro.second});
+		}
+		std::sort(sorted.begin(), sorted.end());
+		std::string key;
+		for (auto &macro : sorted) {
+			key += macro.first;
+			key += '\0';
+			key.append((const char *)&macro.second,
+			           sizeof(macro.second));
+		}
+		hash = llvm::xxHash64(key);
+		return true;
+	}
+};
+
+// Globals declared in headers, with their uses in main files and other
+// headers. Each header included by the TU is either analyzed here, from
+// the events of its decls, or found in the HeaderCache, in which case the
+// visitor may skip its decls (see isCached()). Summaries are only cached
+// for TUs preprocessed from source, whose MacroFingerprints are known.
+class HeaderGlobalPass : public GlobalAnalysisPass {
+      private:
+	struct Header {
+		// non system header, not excluded by the path filter
+		bool analyzable = false;
+		std::string path;
+		std::shared_ptr<const HeaderSummary> cached;
+		// analyzed in this TU, stored under cacheKey when done
+		std::unique_ptr<HeaderSummary> building;
+		bool cacheable = false;
+		uint64_t cacheKey = 0;
+		// globals and uses already in `building`
+		llvm::StringSet<> seen;
+		// not reported by this process yet
+		bool report = false;
+	};
+
+	llvm::DenseMap<FileID, std::unique_ptr<Header>> headers;
+	// uses in the main file, by key
+	llvm::DenseMap<uint64_t, unsigned> mainFileUses;
+	// uses in headers that are traversed but not analyzed
+	llvm::DenseSet<uint64_t> headerUses;
+	const MacroFingerprints *macros = nullptr;
+
+	static uint64_t globalKey(llvm::StringRef header, llvm::StringRef name) {
+		return llvm::xxHash64(header.str() + '\0' + name.str());
+	}
+
+	static bool isHeaderGlobal(VarDecl *decl) {
+		return decl->hasGlobalStorage() && !decl->isStaticLocal();
+	}
+
+	FileID fileOf(SourceLocation loc) {
+		auto &sm = context->getSourceManager();
+		return sm.getFileID(sm.getExpansionLoc(loc));
+	}
+
+	std::string pathOf(const FileEntry *file) {
+		auto path = file->tryGetRealPathName();
+		return path.empty() ? absolutePath(file->getName()) : path.str();
+	}
+
+	Header &header(FileID fid) {
+		auto &entry = headers[fid];
+		if (entry)
+			return *entry;
+		entry = std::make_unique<Header>();
+		auto &sm = context->getSourceManager();
+		auto file = sm.getFileEntryForID(fid);
+		if (fid == sm.getMainFileID() || file == nullptr ||
+		    sm.isInSystemHeader(sm.getLocForStartOfFile(fid)))
+			return *entry;
+		if (isSourceFileName(file->getName()) ||
+		    sm.isLoadedFileID(fid))
+			return *entry;
+		entry->path = pathOf(file);
+		if (!pathFilter().empty() && !pathFilter().allows(entry->path))
+			return *entry;
+		entry->analyzable = true;
+
+		uint64_t macroHash;
+		if (!macros || !macros->fingerprint(fid, macroHash)) {
+			entry->building = std::make_unique<HeaderSummary>();
+			entry->report = true;
+			return *entry;
+		}
+		// keyed by path too, as uses of other headers' globals are
+		// recorded by path
+		entry->cacheable = true;
+		entry->cacheKey =
+		    llvm::xxHash64(sm.getBufferData(fid)) ^
+		    (llvm::xxHash64(entry->path) * 0x9E3779B97F4A7C15ull) ^
+		    (macroHash * 0xC2B2AE3D27D4EB4Full);
+		entry->cached = headerCache().lookup(entry->cacheKey, entry->report);
+		if (entry->cached)
+			headerCacheHits++;
+		else
+			entry->building = std::make_unique<HeaderSummary>();
+		return *entry;
+	}
+
+	// `decl` is declared in a header, `use` anywhere
+	void noteUse(VarDecl *decl, Expr *use) {
+		auto &declared = header(fileOf(decl->getLocation()));
+		if (!declared.analyzable)
+			return;
+		auto name = decl->getQualifiedNameAsString();
+		auto key = globalKey(declared.path, name);
+		auto fid = fileOf(use->getBeginLoc());
+		if (fid == context->getSourceManager().getMainFileID()) {
+			mainFileUses[key]++;
+			return;
+		}
+		auto &user = header(fid);
+		if (user.building) {
+			if (user.seen.insert(declared.path + '\0' + name).second)
+				user.building->uses.push_back({declared.path, name});
+		}
+		headerUses.insert(key);
+	}
+
+	void report(const Header &header, const HeaderSummary &summary) {
+		for (auto &global : summary.globals) {
+			HeaderGlobalSummary entry{
+			    globalKey(header.path, global.name), global.name,
+			    header.path + ":" + std::to_string(global.line),
+			    false, "", 0};
+			headerGlobalHook(entry);
+		}
+		for (auto &use : summary.uses) {
+			headerGlobalHook({globalKey(use.first, use.second), "", "",
+			                  true, "", 0});
+		}
+	}
+
+      public:
+	HeaderGlobalPass(ASTContext *context, DiagnosticsEngine &d,
+	                 GlobalTable &table)
+	    : GlobalAnalysisPass(context, d, table) {}
+
+	void setMacros(const MacroFingerprints *fingerprints) {
+		macros = fingerprints;
+	}
+
+	// The decl is in a header analyzed by an earlier TU with the same
+	// macros. It only needs to be traversed for its uses of the main
+	// file's globals, see ScopeCheckerVisitor::isCachedHeaderDecl().
+	bool isCached(Decl *decl) {
+		return header(fileOf(decl->getLocation())).cached != nullptr;
+	}
+
+	void onHeaderGlobal(VarDecl *decl) override {
+		if (!isHeaderGlobal(decl))
+			return;
+		auto &h = header(fileOf(decl->getLocation()));
+		if (!h.building)
+			return;
+		auto name = decl->getQualifiedNameAsString();
+		// redeclarations in the same header
+		if (!h.seen.insert(name).second)
+			return;
+		auto line = context->getSourceManager().getExpansionLineNumber(
+		    decl->getLocation());
+		h.building->globals.push_back({name, line});
+	}
+
+	void onHeaderReference(VarDecl *decl, DeclRefExpr *ref) override {
+		if (isHeaderGlobal(decl))
+			noteUse(decl, ref);
+	}
+
+	// a global of the main file. Its first declaration may still be in a
+	// header, as for an extern declaration defined in the main file.
+	void onReference(VarDecl *decl, DeclRefExpr *ref,
+	                 CompoundStmt *scope) override {
+		auto &sm = context->getSourceManager();
+		if (!sm.isInMainFile(sm.getExpansionLoc(decl->getLocation())))
+			noteUse(decl, ref);
+	}
+
+	void finish() override {
+		for (auto &entry : headers) {
+			auto &h = *entry.second;
+			if (h.building) {
+				std::shared_ptr<const HeaderSummary> summary(
+				    std::move(h.building));
+				if (h.cacheable)
+					headerCache().store(h.cacheKey, summary);
+				if (h.report)
+					report(h, *summary);
+			} else if (h.cached && h.report) {
+				report(h, *h.cached);
+			}
+		}
+		auto &sm = context->getSourceManager();
+		auto mainFile = sm.getFileEntryForID(sm.getMainFileID());
+		auto mainPath = mainFile ? pathOf(mainFile) : std::string();
+		for (auto &use : mainFileUses) {
+			headerGlobalHook(
+			    {use.first, "", "", false, mainPath, use.second});
+		}
+		for (auto key : headerUses) {
+			headerGlobalHook({key, "", "", true, "", 0});
+		}
+	}
+};
+
+// Walks the translation unit once, keeps the global table up to date and
+// dispatches declarations, references and scope changes to the passes.
+//
+// A visitor created with a `recording` vector is a worker for -jobs. It
+// only records events and must stay away from anything that mutates
+// shared state: the SourceManager (its FileID lookup cache), the
+// DiagnosticsEngine and lazy deserialization through an external AST
+// source. It only uses the Decl/Stmt accessors of RecursiveASTVisitor,
+// DeclRefExpr::getFoundDecl and VarDecl::getCanonicalDecl, which only read
+// the AST once parsing is done.
+// File filtering is done on the main thread when the events are replayed.
+class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
+      private:
+	using Base = RecursiveASTVisitor<ScopeCheckerVisitor>;
+
+	ASTContext *context;
+	CompoundStmt *parentStmt = nullptr;
+
+	DiagnosticsEngine &d;
+
+	GlobalTable table;
+	std::vector<std::unique_ptr<GlobalAnalysisPass>> passes;
+	// also in passes, if enabled
+	HeaderGlobalPass *headerPass = nullptr;
+	std::vector<TraversalEvent> *recording = nullptr;
+	// with -record-events, the events the table sees
+	std::unique_ptr<TraceWriter> trace;
+	// decls deserialized from a PCH or module are imported, the TU that
+	// built it has analyzed them. Not so for checkDecls() on an AST file.
+	bool skipImported = true;
+
+	int depth = 0;
+	unsigned loopDepth = 0;
+	bool declPrinted = false;
+	// a top level decl of the main file was traversed
+	bool sawMainFileDecl = false;
+
+	// isInHeader() result for each FileID seen so far, the answer only
+	// depends on the file so path matching runs once per file.
+	llvm::DenseMap<FileID, bool> skippedFiles;
+
+	bool isInHeader(Decl *decl) {
+		if (skipImported && decl->isFromASTFile())
+			return true;
+		auto loc = decl->getLocation();
+		auto fid = context->getSourceManager().getFileID(loc);
+		auto cached = skippedFiles.find(fid);
+		if (cached != skippedFiles.end())
+			return cached->second;
+		return skippedFiles[fid] = isSkippedFile(loc);
+	}
+
+	bool isSkippedFile(SourceLocation loc) {
+		auto floc = context->getFullLoc(loc);
+		if (floc.isInSystemHeader())
+			return true;
+		// e.g. a .cppm whose decls come from a module file
+		if (skipImported &&
+		    context->getSourceManager().isLoadedFileID(floc.getFileID()))
+			return true;
+		auto file = floc.getFileEntry();
+		if (file == nullptr)
+			return true;
+		if (isSourceFileName(file->getName())) {
+			return !isAllowedPath(file);
+		}
+		// a module interface unit may have any extension
+		if (floc.getFileID() ==
+		        context->getSourceManager().getMainFileID() &&
+		    context->getLangOpts().getCompilingModule() ==
+		        LangOptions::CMK_ModuleInterface) {
+			return !isAllowedPath(file);
+		}
+		return true;
+	}
+
+	bool isAllowedPath(const FileEntry *file) {
+		if (pathFilter().empty())
+			return true;
+		auto path = file->tryGetRealPathName();
+		return pathFilter().allows(
+		    path.empty() ? realPath(file->getName()) : path.str());
+	}
+
+	bool isExternalGlobal(VarDecl *decl) {
+		return decl->hasGlobalStorage() && decl->isExternallyVisible() &&
+		       !context->getSourceManager().isInSystemHeader(
+		           decl->getLocation());
+	}
+
+	void emit(const TraversalEvent &event) {
+		if (recording) {
+			recording->push_back(event);
+		} else {
+			dispatch(event);
+		}
+	}
+
+	// Traverses `decls` with one worker visitor per chunk, then replays
+	// the recorded events in order.
+	void traverseParallel(llvm::ArrayRef<Decl *> decls, unsigned jobs) {
+		size_t chunkSize = std::max<size_t>(1, decls.size() / (jobs * 8));
+		size_t chunks = (decls.size() + chunkSize - 1) / chunkSize;
+		std::vector<std::vector<TraversalEvent>> events(chunks);
+		std::vector<std::unique_ptr<ScopeCheckerVisitor>> workers;
+		for (size_t i = 0; i < chunks; i++) {
+			workers.push_back(std::make_unique<ScopeCheckerVisitor>(
+			    context, d, &events[i]));
+		}
+
+		llvm::ThreadPool pool(llvm::hardware_concurrency(jobs));
+		for (size_t i = 0; i < chunks; i++) {
+			auto chunk = decls.slice(
+			    i * chunkSize,
+			    std::min(chunkSize, decls.size() - i * chunkSize));
+			auto worker = workers[i].get();
+			pool.async([worker, chunk] {
+				for (auto decl : chunk) {
+					worker->TraverseDecl(decl);
+				}
+			});
+		}
+		pool.wait();
+
+		for (auto &chunk : events) {
+			for (auto &event : chunk) {
+				dispatch(event);
+			}
+		}
+	}
+
+	// Children of a DeclContext that RecursiveASTVisitor skips because it
+	// reaches them through an expression: lambda classes (Sema adds those
+	// of namespace scope lambdas to the context), blocks and captured
+	// statements. Walking them directly would see their bodies twice.
+	static bool isTraversedThroughExpr(const Decl *decl) {
+		if (isa<BlockDecl>(decl) || isa<CapturedDecl>(decl))
+			return true;
+		auto record = dyn_cast<CXXRecordDecl>(decl);
+		return record && record->isLambda();
+	}
+
+	// top level decls in order, namespaces are flattened so that one
+	// big namespace doesn't end up in a single chunk
+	static void collectDecls(DeclContext *dc, std::vector<Decl *> &out) {
+		for (auto decl : dc->decls()) {
+			if (isTraversedThroughExpr(decl))
+				continue;
+			if (isa<NamespaceDecl>(decl) || isa<LinkageSpecDecl>(decl)) {
+				collectDecls(cast<DeclContext>(decl), out);
+			} else {
+				out.push_back(decl);
+			}
+		}
+	}
+
+      public:
+	explicit ScopeCheckerVisitor(ASTContext *context, DiagnosticsEngine &d,
+	                             std::vector<TraversalEvent> *recording =
+	                                 nullptr)
+	    : context(context), d(d), recording(recording) {
+		if (recording) {
+			return;
+		}
+		if (!options.recordEvents.empty()) {
+			trace = std::make_unique<TraceWriter>();
+		}
+		passes.push_back(
+		    std::make_unique<RedundantScopePass>(context, d, table));
+		if (globalSummaryHook) {
+			passes.push_back(
+			    std::make_unique<SummaryPass>(context, d, table));
+		}
+		if (headerGlobalHook) {
+			auto pass =
+			    std::make_unique<HeaderGlobalPass>(context, d, table);
+			headerPass = pass.get();
+			passes.push_back(std::move(pass));
+		}
+		if (options.hoistLocals) {
+			passes.push_back(
+			    std::make_unique<HoistLocalPass>(context, d, table));
+		}
+		if (options.relocations) {
+			passes.push_back(
+			    std::make_unique<RelocationPass>(context, d, table));
+		}
+		if (options.constexprTables) {
+			passes.push_back(std::make_unique<StartupTablePass>(
+			    context, d, table));
+		}
+		if (options.frozenContainers) {
+			passes.push_back(std::make_unique<FrozenContainerPass>(
+			    context, d, table));
+		}
+		if (options.soa) {
+			passes.push_back(std::make_unique<StructOfArraysPass>(
+			    context, d, table));
+		}
+		if (options.padding) {
+			passes.push_back(
+			    std::make_unique<PaddingPass>(context, d, table));
+		}
+		if (auto size = largeCopySize()) {
+			passes.push_back(std::make_unique<LargeCopyPass>(
+			    context, d, table, size));
+		}
+		if (options.volatileLoops) {
+			passes.push_back(std::make_unique<VolatileLoopPass>(
+			    context, d, table));
+		}
+	}
+
+	// For checkDecls(), whose decls all come from the AST file.
+	void analyzeImportedDecls() { skipImported = false; }
+
+	// Decls of a header analyzed by an earlier TU are skipped up to the
+	// first decl of the main file. Header code can only use the main
+	// file's globals declared before it, and the summary doesn't cover
+	// such uses, so from there on every decl is traversed. With
+	// -whole-program nothing is skipped: the summary also needs the
+	// external globals header code uses.
+	bool isCachedHeaderDecl(Decl *decl) {
+		if (!headerPass || globalSummaryHook || sawMainFileDecl)
+			return false;
+		auto &sm = context->getSourceManager();
+		if (sm.isInMainFile(sm.getExpansionLoc(decl->getLocation()))) {
+			sawMainFileDecl = true;
+			return false;
+		}
+		return headerPass->isCached(decl);
+	}
+
+	// Header decls with a cached summary, and imported ones, are
+	// skipped. Must be called in the order of the TU.
+	void traverseTopLevelDecl(Decl *decl) {
+		if (skipImported && decl->isFromASTFile()) {
+			return;
+		}
+		if (!isCachedHeaderDecl(decl)) {
+			TraverseDecl(decl);
+		}
+	}
+
+	// Header summaries are only cached when the macros each header
+	// depends on are known, i.e. for TUs preprocessed from source.
+	void trackMacros(Preprocessor &pp) {
+		if (!headerPass)
+			return;
+		auto macros = std::make_unique<MacroFingerprints>(pp);
+		headerPass->setMacros(macros.get());
+		pp.addPPCallbacks(std::move(macros));
+	}
+
+	void traverseTranslationUnit(TranslationUnitDecl *tu) {
+		auto jobs = jobCount();
+		// Only the decls parsed in this TU. decls() would deserialize
+		// every decl of a PCH to hand it over, noload_decls() doesn't,
+		// and decls from imported modules aren't traversed either.
+		// Sequential, workers can't share lazy deserialization.
+		if (context->getExternalSource()) {
+			for (auto decl : tu->noload_decls()) {
+				if (!isTraversedThroughExpr(decl))
+					traverseTopLevelDecl(decl);
+			}
+			return;
+		}
+		if (jobs == 1 || options.dumpAst) {
+			if (!headerPass) {
+				TraverseDecl(tu);
+				return;
+			}
+			for (auto decl : tu->decls()) {
+				if (!isTraversedThroughExpr(decl))
+					traverseTopLevelDecl(decl);
+			}
+			return;
+		}
+		std::vector<Decl *> decls, traversed;
+		collectDecls(tu, decls);
+		for (auto decl : decls) {
+			if (!isCachedHeaderDecl(decl))
+				traversed.push_back(decl);
+		}
+		traverseParallel(traversed, jobs);
+	}
+
+	void dispatch(const TraversalEvent &event) {
+		switch (event.kind) {
+		case TraversalEvent::Global: {
+			// Ignore variables defined in headers
+			if (isInHeader(event.decl)) {
+				for (auto &pass : passes) {
+					pass->onHeaderGlobal(event.decl);
+				}
+				return;
+			}
+			auto cd = event.decl->getCanonicalDecl();
+			table.add(cd);
+			if (trace) {
+				trace->global(cd, cd->getName());
+			}
+			for (auto &pass : passes) {
+				pass->onGlobal(cd);
+			}
+			break;
+		}
+		case TraversalEvent::Reference:
+			if (isInHeader(event.ref->getFoundDecl()) ||
+			    !table.isTracked(event.decl)) {
+				if (isInHeader(event.ref->getFoundDecl())) {
+					auto found =
+					    cast<VarDecl>(event.ref->getFoundDecl());
+					for (auto &pass : passes) {
+						pass->onHeaderReference(found,
+						                        event.ref);
+					}
+				}
+				if (isExternalGlobal(event.decl)) {
+					for (auto &pass : passes) {
+						pass->onExternalReference(
+						    event.decl, event.ref);
+					}
+				}
+				return;
+			}
+			// add the current compound statement to
+			// usages vector
+			table.addUse(event.decl, event.ref, event.scope);
+			if (trace) {
+				trace->reference(event.decl, event.scope);
+			}
+			for (auto &pass : passes) {
+				pass->onReference(event.decl, event.ref,
+				                  event.scope);
+			}
+			break;
+		case TraversalEvent::ScopeEnter:
+			if (trace) {
+				trace->scopeEnter(event.scope, event.parent,
+				                  event.loopDepth);
+			}
+			for (auto &pass : passes) {
+				pass->onScopeEnter(event.scope,
+				                   event.loopDepth);
+			}
+			break;
+		case TraversalEvent::ScopeExit:
+			table.mergeAll(event.scope, event.parent);
+			if (trace) {
+				trace->scopeExit(event.scope, event.parent);
+			}
+			for (auto &pass : passes) {
+				pass->onScopeExit(event.scope, event.parent);
+			}
+			break;
+		case TraversalEvent::Local:
+			if (isInHeader(event.decl)) {
+				return;
+			}
+			for (auto &pass : passes) {
+				pass->onLocal(event.decl, event.loopDepth);
+			}
+			break;
+		}
+	}
+
+	void finish() {
+		for (auto &pass : passes) {
+			pass->finish();
+		}
+	}
+
+	// Writes the -record-events trace to `path`, or to a file named
+	// after `mainFile` if `path` is a directory.
+	void writeTrace(llvm::StringRef path, llvm::StringRef mainFile) {
+		if (!trace) {
+			return;
+		}
+		llvm::SmallString<256> target(path);
+		if (llvm::sys::fs::is_directory(path)) {
+			char name[24];
+			snprintf(name, sizeof(name), "%016llx.rcse",
+			         (unsigned long long)llvm::xxHash64(mainFile));
+			llvm::sys::path::append(target, name);
+		}
+		int fd;
+		llvm::SmallString<256> tmp;
+		if (llvm::sys::fs::createUniqueFile(target.str() + ".%%%%%%%%",
+		                                    fd, tmp)) {
+			verbose("cannot write event trace to ", target);
+			return;
+		}
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			os << trace->data();
+			if (os.has_error()) {
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return;
+			}
+		}
+		if (llvm::sys::fs::rename(tmp, target))
+			llvm::sys::fs::remove(tmp);
+	}
+
+	bool VisitDeclRefExpr(DeclRefExpr *e) {
+		if (const auto decl = e->getFoundDecl()) {
+			if (decl->getKind() == Decl::Kind::Var) {
+				VarDecl *vd = dynamic_cast<VarDecl *>(decl)
+						  ->getCanonicalDecl();
+				// parameters are never tracked
+				if (!isa<ParmVarDecl>(vd)) {
+					emit({TraversalEvent::Reference, vd, e,
+					      parentStmt, nullptr});
+				}
+			}
+		}
+		return true;
+	}
+
+	bool VisitVarDecl(VarDecl *decl) {
+		// ignore function parameters
+		if (auto const pd = dynamic_cast<ParmVarDecl *>(decl)) {
+			return true;
+		}
+		if (depth == 0) {
+			emit({TraversalEvent::Global, decl, nullptr, nullptr,
+			      nullptr});
+		} else if (options.hoistLocals && decl->hasLocalStorage()) {
+			emit({TraversalEvent::Local, decl, nullptr, nullptr,
+			      nullptr, loopDepth});
+		}
+		return true;
+	}
+
+	bool VisitDecl(Decl *decl) {
+		if (recording) {
+			return true;
+		}
+		if (!isInHeader(decl) && options.dumpAst && !declPrinted) {
+			decl->dumpColor();
+			declPrinted = true;
+		}
+		return true;
+	}
+
+	// a scope generally begins with a compound statement
 	// We need to produce a warning with few notes
 	// Location of declaration, and the first compound statement
 	// in which the declaration is used.
@@ -313,16 +3442,45 @@ class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
 		depth++;
 		auto parent = parentStmt;
 		parentStmt = stmt;
+		emit({TraversalEvent::ScopeEnter, nullptr, nullptr, stmt, parent,
+		      loopDepth});
 		auto result =
 		    static_cast<RecursiveASTVisitor<ScopeCheckerVisitor> *>(
 			this)
 			->TraverseCompoundStmt(stmt);
-		mergeAll(stmt, parent);
+		emit({TraversalEvent::ScopeExit, nullptr, nullptr, stmt, parent});
 		parentStmt = parent;
 		depth--;
 		return result;
 	}
 
+	// Loops are counted for the placement advice. The whole statement
+	// counts, a block in the condition (a lambda) runs every iteration too.
+	template <typename Fn> bool traverseLoop(Fn traverse) {
+		loopDepth++;
+		auto result = traverse();
+		loopDepth--;
+		return result;
+	}
+
+	bool TraverseForStmt(ForStmt *stmt) {
+		return traverseLoop([&] { return Base::TraverseForStmt(stmt); });
+	}
+
+	bool TraverseCXXForRangeStmt(CXXForRangeStmt *stmt) {
+		return traverseLoop(
+		    [&] { return Base::TraverseCXXForRangeStmt(stmt); });
+	}
+
+	bool TraverseWhileStmt(WhileStmt *stmt) {
+		return traverseLoop(
+		    [&] { return Base::TraverseWhileStmt(stmt); });
+	}
+
+	bool TraverseDoStmt(DoStmt *stmt) {
+		return traverseLoop([&] { return Base::TraverseDoStmt(stmt); });
+	}
+
 	bool TraverseDecl(Decl *decl) {
 		auto oldDeclPrinted = declPrinted;
 		auto result =
@@ -334,21 +3492,185 @@ class ScopeCheckerVisitor : public RecursiveASTVisitor<ScopeCheckerVisitor> {
 	}
 };
 
+// Passes the checker's diagnostics on to the compiler's consumer and
+// keeps a copy for -sample-log. The log has one file per TU, replaced by
+// each analysis of the TU, so that the collector sees the latest findings
+// of every TU analyzed during the period it looks at:
+//
+//   tu <absolute path of the main file>
+//   build <build id>
+//   time <unix time>
+//   <findings as file:line:col: level: message lines>
+class SampleLog : public DiagnosticConsumer {
+      private:
+	DiagnosticConsumer *next;
+	std::string findings;
+
+      public:
+	explicit SampleLog(DiagnosticConsumer *next) : next(next) {}
+
+	void HandleDiagnostic(DiagnosticsEngine::Level level,
+	                      const Diagnostic &info) override {
+		DiagnosticConsumer::HandleDiagnostic(level, info);
+		next->HandleDiagnostic(level, info);
+
+		llvm::raw_string_ostream os(findings);
+		if (info.hasSourceManager() && info.getLocation().isValid()) {
+			auto loc = info.getSourceManager().getPresumedLoc(
+			    info.getLocation());
+			if (loc.isValid()) {
+				os << loc.getFilename() << ":" << loc.getLine()
+				   << ":" << loc.getColumn() << ": ";
+			}
+		}
+		os << (level == DiagnosticsEngine::Note      ? "note: "
+		       : level == DiagnosticsEngine::Warning ? "warning: "
+		                                             : "error: ");
+		llvm::SmallString<128> message;
+		info.FormatDiagnostic(message);
+		os << message << "\n";
+	}
+
+	// written to a unique file and renamed over the TU's last record
+	void write(llvm::StringRef directory, llvm::StringRef mainFile) {
+		llvm::sys::fs::create_directories(directory);
+		char name[24];
+		snprintf(name, sizeof(name), "%016llx.log",
+		         (unsigned long long)llvm::xxHash64(mainFile));
+		llvm::SmallString<256> path(directory);
+		llvm::sys::path::append(path, name);
+		int fd;
+		llvm::SmallString<256> tmp;
+		if (llvm::sys::fs::createUniqueFile(path.str() + ".%%%%%%%%", fd,
+		                                    tmp))
+			return;
+		{
+			llvm::raw_fd_ostream os(fd, true);
+			auto now = std::chrono::duration_cast<std::chrono::seconds>(
+			    std::chrono::system_clock::now().time_since_epoch());
+			os << "tu " << mainFile << "\n";
+			os << "build " << buildId() << "\n";
+			os << "time " << now.count() << "\n";
+			os << findings;
+			if (os.has_error()) {
+				os.clear_error();
+				llvm::sys::fs::remove(tmp);
+				return;
+			}
+		}
+		if (llvm::sys::fs::rename(tmp, path))
+			llvm::sys::fs::remove(tmp);
+	}
+};
+
+// Sema hands the definitions it instantiates at the end of the TU to
+// HandleTopLevelDecl. The traversal of the TU never visits them, their
+// uses are those of the template.
+static bool isImplicitInstantiation(const Decl *decl) {
+	auto var = dyn_cast<VarDecl>(decl);
+	if (var &&
+	    var->getTemplateSpecializationKind() == TSK_ImplicitInstantiation)
+		return true;
+	auto dc = dyn_cast<DeclContext>(decl);
+	for (dc = dc ? dc : decl->getDeclContext(); dc; dc = dc->getParent()) {
+		auto kind = TSK_Undeclared;
+		if (auto function = dyn_cast<FunctionDecl>(dc)) {
+			kind = function->getTemplateSpecializationKind();
+		} else if (auto record = dyn_cast<CXXRecordDecl>(dc)) {
+			kind = record->getTemplateSpecializationKind();
+		}
+		if (kind == TSK_ImplicitInstantiation)
+			return true;
+	}
+	return false;
+}
+
 class ScopeCheckerConsumer : public ASTConsumer {
 	CompilerInstance &instance;
 	ScopeCheckerVisitor visitor;
 
+	// absolute path of the main file, empty if it isn't a file
+	std::string mainFilePath() {
+		auto &sm = instance.getSourceManager();
+		auto mainFile = sm.getFileEntryForID(sm.getMainFileID());
+		if (mainFile == nullptr) {
+			return "";
+		}
+		auto path = mainFile->tryGetRealPathName();
+		return path.empty() ? absolutePath(mainFile->getName())
+		                    : path.str();
+	}
+
+	// runs the passes with the diagnostics going through a SampleLog
+	void finishLogged(llvm::StringRef directory) {
+		auto &d = instance.getDiagnostics();
+		auto mainFile = mainFilePath();
+		if (mainFile.empty()) {
+			visitor.finish();
+			return;
+		}
+		auto client = d.getClient();
+		auto owner = d.takeClient();
+		SampleLog log(client);
+		d.setClient(&log, false);
+		visitor.finish();
+		d.setClient(client, owner != nullptr);
+		owner.release();
+		log.write(directory, mainFile);
+	}
+
       public:
 	ScopeCheckerConsumer(CompilerInstance &instance)
-	    : instance(instance), visitor(&instance.getASTContext(), instance) {
+	    : instance(instance),
+	      visitor(&instance.getASTContext(), instance.getDiagnostics()) {
+		visitor.trackMacros(instance.getPreprocessor());
+	}
+
+	// With -on-parse, each top level decl is analyzed right after the
+	// parser hands it over, while its AST is still hot in the cache, and
+	// there is no walk over the TU at the end. Inline member function
+	// bodies are parsed before their class is handed over, so they are
+	// included. Clang has no plugin hook inside Sema's name resolution or
+	// its compound statement actions, so this is the earliest point at
+	// which references and blocks can be seen.
+	virtual bool HandleTopLevelDecl(DeclGroupRef group) override {
+		if (options.onParse) {
+			for (auto decl : group) {
+				if (!isImplicitInstantiation(decl)) {
+					visitor.traverseTopLevelDecl(decl);
+				}
+			}
+		}
+		return true;
 	}
 
 	virtual void HandleTranslationUnit(ASTContext &context) override {
-		visitor.TraverseDecl(context.getTranslationUnitDecl());
-		visitor.printRedundant();
+		if (!options.onParse) {
+			visitor.traverseTranslationUnit(
+			    context.getTranslationUnitDecl());
+		}
+		if (options.sampleLog.empty()) {
+			visitor.finish();
+		} else {
+			finishLogged(options.sampleLog.back());
+		}
+		if (!options.recordEvents.empty()) {
+			visitor.writeTrace(options.recordEvents.back(),
+			                   mainFilePath());
+		}
 	}
 };
 
+void checkDecls(ASTContext &context, DiagnosticsEngine &diagnostics,
+                llvm::ArrayRef<Decl *> decls) {
+	ScopeCheckerVisitor visitor(&context, diagnostics);
+	visitor.analyzeImportedDecls();
+	for (auto decl : decls) {
+		visitor.TraverseDecl(decl);
+	}
+	visitor.finish();
+}
+
 class ScopeCheckerAction : public PluginASTAction {
       private:
 	bool dumpAst;
@@ -356,7 +3678,23 @@ class ScopeCheckerAction : public PluginASTAction {
       protected:
 	virtual std::unique_ptr<ASTConsumer>
 	CreateASTConsumer(CompilerInstance &instance,
-	                  llvm::StringRef) override {
+	                  llvm::StringRef inFile) override {
+		loadChangedLines();
+		if (options.onParse && jobCount() > 1) {
+			fatal("-on-parse can't be combined with -jobs");
+		}
+		if (!pathFilter().empty() || sampleRate() > 1) {
+			auto path = realPath(inFile);
+			if (!pathFilter().allows(path)) {
+				verbose("skipping excluded file ", path);
+				// nothing to analyze, don't walk the AST at all
+				return std::make_unique<ASTConsumer>();
+			}
+			if (!isSampled(path)) {
+				verbose("not in this build's sample: ", path);
+				return std::make_unique<ASTConsumer>();
+			}
+		}
 		return std::make_unique<ScopeCheckerConsumer>(instance);
 	}
 
@@ -369,8 +3707,26 @@ class ScopeCheckerAction : public PluginASTAction {
 	virtual PluginASTAction::ActionType getActionType() override {
 		return PluginASTAction::AddBeforeMainAction;
 	}
+
+	// once per process, the driver may create actions on many threads
+	static void loadChangedLines() {
+		static bool loaded = [] {
+			for (auto &file : options.changedLines) {
+				std::string error;
+				if (!changeSet().load(file, error)) {
+					fatal(error);
+				}
+			}
+			return true;
+		}();
+		(void)loaded;
+	}
 };
 
+std::unique_ptr<FrontendAction> createScopeCheckerAction() {
+	return std::make_unique<ScopeCheckerAction>();
+}
+
 static FrontendPluginRegistry::Add<ScopeCheckerAction> ScopeChecker(
     "RedundantScopeChecker",
     "Warn against redundantly global-scoped variable declarations.");
@@ -0,0 +1,122 @@
+#ifndef REDUNDANT_SCOPE_CHECKER_H
+#define REDUNDANT_SCOPE_CHECKER_H
+
+// Interface shared between the clang plugin and the rcs-batch driver, which
+// links the plugin sources directly and runs the checker as a regular
+// frontend action.
+
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "clang/AST/ASTContext.h"
+#include "clang/Basic/Diagnostic.h"
+#include "clang/Frontend/FrontendAction.h"
+#include "llvm/ADT/ArrayRef.h"
+#include "llvm/ADT/StringMap.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/raw_ostream.h"
+
+// Parse plugin options, same strings as given with -plugin-arg-...
+void parseArgs(const std::vector<std::string> &args);
+
+std::unique_ptr<clang::FrontendAction> createScopeCheckerAction();
+
+// Run the checker on already parsed top level decls, e.g. the main file
+// decls of a deserialized AST. Warnings are reported to `diagnostics`.
+void checkDecls(clang::ASTContext &context,
+                clang::DiagnosticsEngine &diagnostics,
+                llvm::ArrayRef<clang::Decl *> decls);
+
+// Per translation unit summary of a global with external linkage, for
+// whole program checks in the driver.
+struct GlobalSummary {
+	// xxHash64 of the linkage (mangled) name, same in every TU
+	uint64_t symbolHash;
+	std::string name;
+	// file:line of the declaration seen by this TU
+	std::string location;
+	// this TU contains the definition
+	bool defined;
+	// uses in this TU
+	unsigned references;
+	// top level module owning the global, empty outside of modules. The
+	// module's interface unit reports the definition, importers only
+	// their uses.
+	std::string module;
+	// exported from the module, otherwise it has module linkage
+	bool exported = false;
+};
+
+// Called for each such global at the end of every translation unit, from
+// the thread that analyzed it. Set before any analysis starts.
+void setGlobalSummaryHook(std::function<void(const GlobalSummary &)> hook);
+
+// A global declared in a (non system) header, for build wide checks of
+// header globals in the driver. What only depends on the header (the
+// declaration, uses by code in headers) is reported once per process for
+// each header; uses in a main file are reported by every TU that has some.
+// Entries for the same global share `key` and are merged by the driver.
+struct HeaderGlobalSummary {
+	// xxHash64 of the declaring header's path and the qualified name
+	uint64_t key;
+	// name and file:line, set for the declaration only
+	std::string name;
+	std::string location;
+	// used by code in a header
+	bool usedInHeaders;
+	// absolute path of the main file using it, and its number of uses
+	std::string mainFile;
+	unsigned mainFileUses;
+};
+
+// Enables the header global analysis. Called at the end of every TU, from
+// the thread that analyzed it. Set before any analysis starts.
+void setHeaderGlobalHook(
+    std::function<void(const HeaderGlobalSummary &)> hook);
+
+// Keeps the per header part of the analysis in `directory`, keyed by the
+// header's path and contents, so that each header is analyzed once per
+// build instead of once per TU including it. Without it, results are only
+// shared between the TUs of one process.
+void setHeaderCacheDirectory(const std::string &directory);
+
+// Headers whose analysis was reused since the last call, counted for the
+// calling thread.
+unsigned takeHeaderCacheHits();
+
+// Changed line ranges per file, used to limit findings to the lines
+// touched by a diff. One entry per line in the list file:
+//
+//   path                 the whole file changed
+//   path:10-20,31        lines 10 to 20 and line 31 changed
+//
+// Relative paths are resolved against the current directory, and paths
+// are compared with symlinks resolved.
+class ChangeSet {
+      private:
+	// absolute path -> inclusive line ranges. Empty means whole file.
+	llvm::StringMap<std::vector<std::pair<unsigned, unsigned>>> files;
+
+      public:
+	bool load(llvm::StringRef listFile, std::string &error);
+	// in the list file format, with absolute paths
+	void write(llvm::raw_ostream &os) const;
+
+	// the form of `path` the set is keyed by
+	static std::string normalize(llvm::StringRef path);
+
+	bool empty() const { return files.empty(); }
+
+	bool containsFile(llvm::StringRef path) const;
+	bool containsLine(llvm::StringRef path, unsigned line) const;
+};
+
+// Filled from -changed-lines, or directly by the driver. Findings are only
+// reported for globals declared or used in these lines, unless empty.
+ChangeSet &changeSet();
+
+#endif
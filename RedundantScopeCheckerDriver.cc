@@ -0,0 +1,1490 @@
+// rcs-batch: runs the checker over the translation units of a compilation
+// database, without going through the compiler's plugin interface.
+//
+// With -changed-files, only the translation units affected by a change are
+// analyzed: a TU is selected if its main file, or any file listed in its
+// dependency file from the last build, is in the change list. Findings are
+// limited to globals declared or used in the changed lines.
+//
+// With -ast, serialized ASTs (clang -emit-ast) are analyzed instead of
+// compiling sources. Only the decls of the main file are deserialized.
+//
+// Translation units are analyzed on -j worker threads. Findings are
+// deduplicated across TUs (the same file may be compiled in several
+// configurations), and with -whole-program the per TU summaries of globals
+// with external linkage are merged to find those no other TU uses.
+// -header-globals does the same for globals declared in headers, whose
+// per header part is only computed once per header (-header-cache shares
+// it between processes).
+//
+// compile_commands.json is streamed through CompileCommandsReader, so the
+// first TU starts before the database is fully read.
+//
+// Runs too large for one machine are split with -coordinator: the TUs are
+// sharded into a shared directory, -worker processes (local with -spawn,
+// or on other machines sharing the directory) claim and analyze shards,
+// and the coordinator merges their binary results. See runCoordinator().
+//
+// -progress and -metrics=<file> report how far the run is, see
+// BatchMetrics.h.
+//
+// -pack writes the sources and headers of the database into one snapshot
+// file, and -snapshot reads them back from it instead of the source tree
+// (see SnapshotFileSystem.h), for workers that receive the tree as a
+// single file.
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#if defined(__linux__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#include "BatchMetrics.h"
+#include "CompileCommandsReader.h"
+#include "RedundantScopeChecker.h"
+#include "ResultsTable.h"
+#include "SnapshotFileSystem.h"
+#include "clang/Basic/FileManager.h"
+#include "clang/Frontend/ASTUnit.h"
+#include "clang/Frontend/CompilerInstance.h"
+#include "clang/Frontend/TextDiagnosticPrinter.h"
+#include "clang/Serialization/PCHContainerOperations.h"
+#include "clang/Tooling/ArgumentsAdjusters.h"
+#include "clang/Tooling/CompilationDatabase.h"
+#include "clang/Tooling/Tooling.h"
+#include "llvm/ADT/StringExtras.h"
+#include "llvm/ADT/StringSet.h"
+#include "llvm/Support/Allocator.h"
+#include "llvm/Support/CommandLine.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/JSON.h"
+#include "llvm/Support/Program.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/Process.h"
+#include "llvm/Support/StringSaver.h"
+#include "llvm/Support/ThreadPool.h"
+#include "llvm/Support/Threading.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/xxhash.h"
+#include "llvm/Support/raw_ostream.h"
+using namespace clang;
+using namespace llvm;
+
+static cl::OptionCategory category("rcs-batch options");
+
+static cl::opt<std::string>
+    buildPath("p", cl::desc("Build directory containing compile_commands.json"),
+              cl::value_desc("dir"), cl::cat(category));
+
+static cl::list<std::string>
+    astFiles("ast", cl::desc("Analyze a serialized AST file (-emit-ast)"),
+             cl::value_desc("file"), cl::cat(category));
+
+static cl::opt<std::string> changedFiles(
+    "changed-files",
+    cl::desc("Only analyze TUs affected by the files in <file>, one "
+             "'path[:first-last,...]' per line"),
+    cl::value_desc("file"), cl::cat(category));
+
+static cl::list<std::string>
+    pluginArgs("plugin-arg", cl::desc("Pass an option to the checker"),
+               cl::value_desc("option"), cl::cat(category));
+
+static cl::opt<unsigned>
+    jobs("j", cl::desc("Number of translation units analyzed in parallel"),
+         cl::value_desc("n"), cl::init(1), cl::cat(category));
+
+static cl::opt<std::string> coordinatorDir(
+    "coordinator",
+    cl::desc("Shard the compilation database into <dir> for -worker "
+             "processes and merge their results"),
+    cl::value_desc("dir"), cl::cat(category));
+
+static cl::opt<unsigned>
+    shardCount("shards", cl::desc("Number of shards for -coordinator"),
+               cl::value_desc("n"), cl::init(8), cl::cat(category));
+
+static cl::opt<unsigned> spawnWorkers(
+    "spawn",
+    cl::desc("Start <n> local worker processes for -coordinator, 0 waits "
+             "for workers started elsewhere"),
+    cl::value_desc("n"), cl::init(0), cl::cat(category));
+
+static cl::opt<unsigned> shardTimeout(
+    "shard-timeout",
+    cl::desc("Fail a -coordinator run without -spawn when a claimed shard "
+             "has no results after <seconds>"),
+    cl::value_desc("seconds"), cl::init(3600), cl::cat(category));
+
+static cl::opt<std::string>
+    workerDir("worker",
+              cl::desc("Analyze unclaimed shards of a coordinator in <dir>"),
+              cl::value_desc("dir"), cl::cat(category));
+
+static cl::opt<unsigned> prefetchDepth(
+    "prefetch",
+    cl::desc("Read the sources of the next <n> TUs into the page cache "
+             "ahead of the workers"),
+    cl::value_desc("n"), cl::init(0), cl::cat(category));
+
+static cl::opt<std::string> packPath(
+    "pack",
+    cl::desc("Write the sources and headers of the database's TUs into a "
+             "snapshot file and exit"),
+    cl::value_desc("file"), cl::cat(category));
+
+static cl::opt<std::string> snapshotPath(
+    "snapshot",
+    cl::desc("Read sources from a snapshot written by -pack, files not in "
+             "it come from the file system"),
+    cl::value_desc("file"), cl::cat(category));
+
+static cl::opt<bool>
+    showProgress("progress",
+                 cl::desc("Show a progress line with the expected time left"),
+                 cl::cat(category));
+
+static cl::opt<std::string> metricsPath(
+    "metrics",
+    cl::desc("Keep per worker counters in <file>, in the Prometheus text "
+             "format"),
+    cl::value_desc("file"), cl::cat(category));
+
+static cl::opt<bool> wholeProgram(
+    "whole-program",
+    cl::desc("Report globals with external linkage that no other "
+             "translation unit uses"),
+    cl::cat(category));
+
+static cl::opt<bool> headerGlobals(
+    "header-globals",
+    cl::desc("Report globals declared in headers that are unused, or only "
+             "used by one source file"),
+    cl::cat(category));
+
+static cl::opt<std::string> headerCacheDir(
+    "header-cache",
+    cl::desc("Keep the analysis of each header in <dir> for "
+             "-header-globals, to reuse it across runs and processes"),
+    cl::value_desc("dir"), cl::cat(category));
+
+// One global across all translation units, merged from GlobalSummary.
+struct ProgramSummary {
+	std::string name;
+	// of the definition, if any TU has one
+	std::string location;
+	unsigned definingUnits;
+	// uses from translation units other than the defining one
+	unsigned foreignReferences;
+	// owning module, if any
+	std::string module;
+	bool exported;
+};
+
+static void mergeSummary(ProgramSummary &existing,
+                         const ProgramSummary &incoming) {
+	if (incoming.definingUnits && !existing.definingUnits)
+		existing.location = incoming.location;
+	if (existing.module.empty())
+		existing.module = incoming.module;
+	existing.exported |= incoming.exported;
+	existing.definingUnits += incoming.definingUnits;
+	existing.foreignReferences += incoming.foreignReferences;
+}
+
+// A warning or error with its notes, as printed by clang.
+struct Finding {
+	std::string text;
+	unsigned count;
+};
+
+static void countDuplicate(Finding &existing, const Finding &incoming) {
+	existing.count += incoming.count;
+}
+
+// One global declared in a header, merged from HeaderGlobalSummary.
+struct HeaderGlobal {
+	// set once the declaration has been reported
+	std::string name;
+	std::string location;
+	bool usedInHeaders;
+	// the first main file using it, and whether there are others
+	std::string mainFile;
+	bool otherMainFiles;
+};
+
+static void mergeHeaderGlobal(HeaderGlobal &existing,
+                              const HeaderGlobal &incoming) {
+	if (existing.location.empty()) {
+		existing.name = incoming.name;
+		existing.location = incoming.location;
+	}
+	existing.usedInHeaders |= incoming.usedInHeaders;
+	existing.otherMainFiles |= incoming.otherMainFiles;
+	if (existing.mainFile.empty())
+		existing.mainFile = incoming.mainFile;
+	else if (!incoming.mainFile.empty() &&
+	         incoming.mainFile != existing.mainFile)
+		existing.otherMainFiles = true;
+}
+
+static ConcurrentTable<ProgramSummary> summaries(mergeSummary);
+static ConcurrentTable<HeaderGlobal> headerGlobalTable(mergeHeaderGlobal);
+static ConcurrentTable<Finding> findings(countDuplicate);
+static std::mutex outputLock;
+// created in main() once -j is known
+static std::unique_ptr<BatchMetrics> metrics;
+// width of the progress line on the terminal, 0 if none, under outputLock
+static size_t progressWidth = 0;
+// set in -worker mode, findings are sent to the coordinator instead
+static bool collectFindingsOnly = false;
+
+// Flushed when the worker thread exits, which is before the pool is gone.
+static StagingBuffer<ProgramSummary> &threadSummaries() {
+	thread_local StagingBuffer<ProgramSummary> buffer(summaries);
+	return buffer;
+}
+
+static void stageSummary(const GlobalSummary &global) {
+	threadSummaries().add(
+	    global.symbolHash,
+	    {global.name, global.location, global.defined ? 1u : 0u,
+	     global.defined ? 0u : global.references, global.module,
+	     global.exported});
+}
+
+static void stageHeaderGlobal(const HeaderGlobalSummary &global) {
+	thread_local StagingBuffer<HeaderGlobal> buffer(headerGlobalTable);
+	buffer.add(global.key, {global.name, global.location,
+	                        global.usedInHeaders, global.mainFile, false});
+}
+
+// Connects the checker to the result tables, for the enabled checks.
+static void installHooks() {
+	if (wholeProgram) {
+		setGlobalSummaryHook(stageSummary);
+	}
+	if (headerGlobals) {
+		setHeaderGlobalHook(stageHeaderGlobal);
+		setHeaderCacheDirectory(headerCacheDir);
+	}
+}
+
+// Formats the diagnostics of one TU like clang does, grouped into
+// findings: a warning or error together with the notes following it.
+class FindingCollector : public DiagnosticConsumer {
+      private:
+	std::string text;
+	raw_string_ostream os;
+	IntrusiveRefCntPtr<DiagnosticOptions> diagnosticOptions;
+	TextDiagnosticPrinter printer;
+	std::vector<std::string> collected;
+
+      public:
+	FindingCollector()
+	    : os(text), diagnosticOptions(new DiagnosticOptions()),
+	      printer(os, diagnosticOptions.get()) {}
+
+	void BeginSourceFile(const LangOptions &langOptions,
+	                     const Preprocessor *pp) override {
+		printer.BeginSourceFile(langOptions, pp);
+	}
+
+	void EndSourceFile() override { printer.EndSourceFile(); }
+
+	void HandleDiagnostic(DiagnosticsEngine::Level level,
+	                      const Diagnostic &info) override {
+		DiagnosticConsumer::HandleDiagnostic(level, info);
+		if (level != DiagnosticsEngine::Note || collected.empty())
+			collected.emplace_back();
+		printer.HandleDiagnostic(level, info);
+		os.flush();
+		collected.back() += text;
+		text.clear();
+	}
+
+	const std::vector<std::string> &getFindings() const {
+		return collected;
+	}
+};
+
+// Erases the progress line before other output, caller holds outputLock.
+static void clearProgress() {
+	if (progressWidth) {
+		errs() << "\r" << std::string(progressWidth, ' ') << "\r";
+		progressWidth = 0;
+	}
+}
+
+// Prints the findings not reported by another TU yet.
+static void printNewFindings(const FindingCollector &collector) {
+	for (auto &finding : collector.getFindings()) {
+		if (findings.insert(xxHash64(finding), {finding, 1}) &&
+		    !collectFindingsOnly) {
+			std::lock_guard<std::mutex> guard(outputLock);
+			clearProgress();
+			errs() << finding;
+		}
+	}
+}
+
+static void printWholeProgram() {
+	std::vector<const ProgramSummary *> unshared;
+	summaries.forEach([&](uint64_t, const ProgramSummary &summary) {
+		if (summary.definingUnits == 1 && summary.foreignReferences == 0)
+			unshared.push_back(&summary);
+	});
+	std::sort(unshared.begin(), unshared.end(),
+	          [](const ProgramSummary *a, const ProgramSummary *b) {
+		          return a->location < b->location;
+	          });
+	for (auto summary : unshared) {
+		if (!summary->module.empty() && summary->exported) {
+			errs() << summary->location << ": warning: '"
+			       << summary->name << "' belongs to module '"
+			       << summary->module
+			       << "' but no importer or other unit of the module "
+			          "uses it, consider not exporting it.\n";
+			continue;
+		}
+		if (!summary->module.empty()) {
+			errs() << summary->location << ": warning: '"
+			       << summary->name << "' belongs to module '"
+			       << summary->module
+			       << "' but no other unit of the module uses it, "
+			          "consider making it static.\n";
+			continue;
+		}
+		errs() << summary->location << ": warning: '" << summary->name
+		       << "' has external linkage but no other translation "
+		          "unit uses it, consider making it static.\n";
+	}
+}
+
+static void printHeaderGlobals() {
+	std::vector<const HeaderGlobal *> local;
+	headerGlobalTable.forEach([&](uint64_t, const HeaderGlobal &global) {
+		// uses of globals whose header isn't analyzed have no location
+		if (!global.location.empty() && !global.usedInHeaders &&
+		    !global.otherMainFiles)
+			local.push_back(&global);
+	});
+	std::sort(local.begin(), local.end(),
+	          [](const HeaderGlobal *a, const HeaderGlobal *b) {
+		          return a->location < b->location;
+	          });
+	for (auto global : local) {
+		errs() << global->location << ": warning: '" << global->name
+		       << "' is declared in a header but ";
+		if (global->mainFile.empty())
+			errs() << "no translation unit uses it.\n";
+		else
+			errs() << "only used in " << global->mainFile
+			       << ", consider moving it there.\n";
+	}
+}
+
+static std::string resolve(StringRef directory, StringRef path) {
+	SmallString<256> result(path);
+	sys::fs::make_absolute(directory, result);
+	sys::path::remove_dots(result, true);
+	return result.str().str();
+}
+
+// Path of the dependency file written for this command in the last build:
+// the -MF argument, or <output>.d next to the object file for -MD/-MMD.
+static std::string depFilePath(const tooling::CompileCommand &cmd) {
+	auto &args = cmd.CommandLine;
+	bool writesDeps = false;
+	std::string output;
+	for (size_t i = 0; i < args.size(); i++) {
+		StringRef arg = args[i];
+		if (arg == "-MF" && i + 1 < args.size())
+			return resolve(cmd.Directory, args[i + 1]);
+		if (arg.startswith("-MF"))
+			return resolve(cmd.Directory, arg.drop_front(3));
+		if (arg == "-MD" || arg == "-MMD")
+			writesDeps = true;
+		if (arg == "-o" && i + 1 < args.size())
+			output = args[i + 1];
+	}
+	if (cmd.Output.size())
+		output = cmd.Output;
+	if (!writesDeps || output.empty())
+		return "";
+	SmallString<256> path(output);
+	sys::path::replace_extension(path, "d");
+	return resolve(cmd.Directory, path);
+}
+
+// Reads the prerequisites of a make style dependency file.
+static bool readDepFile(StringRef path, StringRef directory,
+                        std::vector<std::string> &deps) {
+	auto buffer = MemoryBuffer::getFile(path);
+	if (!buffer)
+		return false;
+	auto text = (*buffer)->getBuffer();
+	auto colon = text.find(": ");
+	if (colon == StringRef::npos)
+		return false;
+	std::string dep;
+	for (size_t i = colon + 1; i < text.size(); i++) {
+		char c = text[i];
+		if (c == '\\' && i + 1 < text.size()) {
+			auto rest = text.substr(i + 1);
+			if (rest.startswith("\r\n") || rest.startswith("\n")) {
+				// line continuation
+				i += rest.startswith("\r") ? 2 : 1;
+				c = ' ';
+			} else if (rest[0] == ' ' || rest[0] == '#') {
+				dep += rest[0];
+				i++;
+				continue;
+			}
+		}
+		if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+			if (!dep.empty())
+				deps.push_back(resolve(directory, dep));
+			dep.clear();
+			// end of the first rule, later ones are -MP phony targets
+			if (c == '\n')
+				return true;
+			continue;
+		}
+		dep += c;
+	}
+	if (!dep.empty())
+		deps.push_back(resolve(directory, dep));
+	return true;
+}
+
+// Dependencies of `cmd` in the last build, false if it has no depfile.
+static bool readDeps(const tooling::CompileCommand &cmd,
+                     std::vector<std::string> &deps) {
+	auto depFile = depFilePath(cmd);
+	return !depFile.empty() && readDepFile(depFile, cmd.Directory, deps);
+}
+
+// `deps` as read by readDeps(), null if there are none.
+static bool isAffected(const tooling::CompileCommand &cmd,
+                       const ChangeSet &changes,
+                       const std::vector<std::string> *deps) {
+	if (changes.containsFile(
+	        ChangeSet::normalize(resolve(cmd.Directory, cmd.Filename))))
+		return true;
+	// not built yet or no dependency output, can't rule it out
+	if (!deps)
+		return true;
+	for (auto &dep : *deps) {
+		if (changes.containsFile(ChangeSet::normalize(dep)))
+			return true;
+	}
+	return false;
+}
+
+static bool isAffected(const tooling::CompileCommand &cmd,
+                       const ChangeSet &changes) {
+	std::vector<std::string> deps;
+	return isAffected(cmd, changes, readDeps(cmd, deps) ? &deps : nullptr);
+}
+
+// Loaded from -snapshot, before any TU starts.
+static Snapshot sourceSnapshot;
+static bool haveSnapshot = false;
+
+static bool runTU(const tooling::CompileCommand &cmd) {
+	auto args = cmd.CommandLine;
+	args = tooling::getClangStripOutputAdjuster()(args, cmd.Filename);
+	args = tooling::getClangStripDependencyFileAdjuster()(args, cmd.Filename);
+	args = tooling::getClangSyntaxOnlyAdjuster()(args, cmd.Filename);
+
+	// own working directory per TU instead of chdir()
+	IntrusiveRefCntPtr<vfs::FileSystem> fs(
+	    vfs::createPhysicalFileSystem().release());
+	if (haveSnapshot) {
+		fs = new SnapshotFileSystem(sourceSnapshot, fs);
+	}
+	fs->setCurrentWorkingDirectory(cmd.Directory);
+	FileManager files(FileSystemOptions(), fs);
+
+	metrics->beginTU(cmd.Filename);
+	FindingCollector collector;
+	tooling::ToolInvocation invocation(args, createScopeCheckerAction(),
+	                                   &files);
+	invocation.setDiagnosticConsumer(&collector);
+	auto result = invocation.run();
+	printNewFindings(collector);
+
+	uint64_t bytes = 0;
+	SmallVector<const FileEntry *, 256> entries;
+	files.GetUniqueIDMapping(entries);
+	for (auto entry : entries) {
+		if (entry)
+			bytes += entry->getSize();
+	}
+	metrics->endTU(bytes, takeHeaderCacheHits(), result);
+	return result;
+}
+
+static bool runASTFile(StringRef path) {
+	IntrusiveRefCntPtr<DiagnosticsEngine> diagnostics =
+	    CompilerInstance::createDiagnostics(new DiagnosticOptions());
+	PCHContainerOperations pchOperations;
+	auto unit = ASTUnit::LoadFromASTFile(
+	    path.str(), pchOperations.getRawReader(), ASTUnit::LoadEverything,
+	    diagnostics, FileSystemOptions(), false, true);
+	if (!unit)
+		return false;
+
+	auto &sm = unit->getSourceManager();
+	auto mainFile = sm.getMainFileID();
+	std::vector<Decl *> decls;
+	if (mainFile.isValid()) {
+		// looks up the file's decl table, so only decls located in the
+		// main file are deserialized
+		SmallVector<Decl *, 64> fileDecls;
+		unit->findFileRegionDecls(mainFile, 0, sm.getFileIDSize(mainFile),
+		                          fileDecls);
+		for (auto decl : fileDecls) {
+			// decls inside namespaces are listed too, they are
+			// traversed through their parent
+			if (isa<TranslationUnitDecl>(decl->getLexicalDeclContext()))
+				decls.push_back(decl);
+		}
+	} else {
+		decls.push_back(unit->getASTContext().getTranslationUnitDecl());
+	}
+
+	diagnostics->getClient()->BeginSourceFile(unit->getLangOpts(),
+	                                          &unit->getPreprocessor());
+	checkDecls(unit->getASTContext(), *diagnostics, decls);
+	diagnostics->getClient()->EndSourceFile();
+	return true;
+}
+
+// Samples the metrics for -progress and -metrics until destroyed, every
+// second on a terminal and every 30 seconds when stderr is a log. The
+// metrics only count this process' TUs: a coordinator has none, its
+// workers report their own.
+class ProgressReporter {
+      private:
+	std::mutex lock;
+	std::condition_variable stopping;
+	bool stopped = false;
+	std::thread thread;
+
+	void report(bool last) {
+		auto sample = metrics->sample();
+		if (!metricsPath.empty()) {
+			// renamed into place, scrapers never see a partial file
+			std::string tmp = metricsPath + ".tmp";
+			std::error_code ec;
+			{
+				raw_fd_ostream os(tmp, ec);
+				if (!ec)
+					writePrometheus(os, sample);
+			}
+			if (!ec)
+				sys::fs::rename(tmp, metricsPath);
+		}
+		if (showProgress) {
+			auto line = progressLine(sample);
+			std::lock_guard<std::mutex> guard(outputLock);
+			if (!sys::Process::StandardErrIsDisplayed()) {
+				errs() << "rcs-batch: " << line << "\n";
+				return;
+			}
+			clearProgress();
+			errs() << line;
+			progressWidth = line.size();
+			if (last) {
+				errs() << "\n";
+				progressWidth = 0;
+			}
+		}
+	}
+
+	void run() {
+		auto interval = std::chrono::seconds(
+		    sys::Process::StandardErrIsDisplayed() ? 1 : 30);
+		std::unique_lock<std::mutex> guard(lock);
+		while (!stopping.wait_for(guard, interval, [&] { return stopped; })) {
+			guard.unlock();
+			report(false);
+			guard.lock();
+		}
+	}
+
+      public:
+	ProgressReporter() {
+		if (!coordinatorDir.empty() &&
+		    (showProgress || !metricsPath.empty())) {
+			errs() << "rcs-batch: warning: -progress and -metrics "
+			          "count each process' TUs, a coordinator has "
+			          "none\n";
+			return;
+		}
+		if (showProgress || !metricsPath.empty())
+			thread = std::thread([this] { run(); });
+	}
+
+	~ProgressReporter() {
+		if (!thread.joinable())
+			return;
+		{
+			std::lock_guard<std::mutex> guard(lock);
+			stopped = true;
+		}
+		stopping.notify_all();
+		thread.join();
+		report(true);
+	}
+};
+
+// Analyzes `commands` on -j threads, returns the number of failed TUs.
+static int runCommands(const std::vector<tooling::CompileCommand> &commands) {
+	std::atomic<int> failed(0);
+	metrics->addExpected(commands.size());
+	ThreadPool pool(hardware_concurrency(jobs));
+	for (auto &cmd : commands) {
+		pool.async([&cmd, &failed] {
+			if (!runTU(cmd)) {
+				std::lock_guard<std::mutex> guard(outputLock);
+				clearProgress();
+				errs() << "rcs-batch: failed to analyze "
+				       << cmd.Filename << "\n";
+				failed++;
+			}
+		});
+	}
+	pool.wait();
+	return failed;
+}
+
+static tooling::CompileCommand toCompileCommand(CompileCommandEntry &entry) {
+	auto args = std::move(entry.arguments);
+	if (args.empty() && !entry.command.empty()) {
+		BumpPtrAllocator allocator;
+		StringSaver saver(allocator);
+		SmallVector<const char *, 64> argv;
+		cl::TokenizeGNUCommandLine(entry.command, saver, argv);
+		args.assign(argv.begin(), argv.end());
+	}
+	return tooling::CompileCommand(entry.directory, entry.file,
+	                               std::move(args), entry.output);
+}
+
+// A database of the one command being streamed, so that it can go through
+// the adjusters loadFromDirectory() puts around a JSON database.
+class StreamedCommand : public tooling::CompilationDatabase {
+      public:
+	tooling::CompileCommand cmd;
+
+	std::vector<tooling::CompileCommand>
+	getCompileCommands(StringRef) const override {
+		return {cmd};
+	}
+
+	std::vector<tooling::CompileCommand>
+	getAllCompileCommands() const override {
+		return {cmd};
+	}
+};
+
+// Asks the kernel to start reading `path` into the page cache, without
+// waiting for it.
+static void prefetchFile(StringRef path) {
+#if defined(__linux__)
+	int fd = ::open(path.str().c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return;
+	posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+	::close(fd);
+#endif
+}
+
+// Hands out the commands of a streamed database to the workers, skipping
+// TUs not affected by -changed-files.
+//
+// With -prefetch=K, a read-ahead thread stays up to K TUs ahead of the
+// workers and prefetches their main files and dependencies (from the
+// depfiles of the last build), so that on a cold cache the parser rarely
+// waits for the disk. Each header is prefetched once.
+class CommandPipeline {
+      private:
+	CompileCommandsReader &reader;
+	unsigned capacity;
+
+	std::mutex lock;
+	std::condition_variable changed;
+	std::deque<tooling::CompileCommand> queue;
+	bool finished = false;
+	std::thread readAhead;
+	// only used by the read-ahead thread
+	StringSet<> prefetched;
+	// guards the reader and the adjusters
+	std::mutex readLock;
+	// expands @file arguments and infers the target and driver mode
+	// from the compiler name, like loadFromDirectory()
+	StreamedCommand *streamed;
+	std::unique_ptr<tooling::CompilationDatabase> adjusted;
+
+	// takes the next command of the database
+	bool take(tooling::CompileCommand &cmd, double &progress) {
+		std::lock_guard<std::mutex> guard(readLock);
+		CompileCommandEntry entry;
+		if (!reader.next(entry))
+			return false;
+		streamed->cmd = toCompileCommand(entry);
+		cmd = adjusted->getAllCompileCommands().front();
+		progress = reader.progress();
+		return true;
+	}
+
+	// Reads the next affected command and, with read-ahead, the
+	// dependencies to prefetch. The depfile is read once for both, and
+	// outside of the lock.
+	bool read(tooling::CompileCommand &cmd, std::vector<std::string> &deps) {
+		double progress;
+		while (take(cmd, progress)) {
+			total++;
+			deps.clear();
+			bool haveDeps = (capacity || !changedFiles.empty()) &&
+			                readDeps(cmd, deps);
+			if (!changedFiles.empty() &&
+			    !isAffected(cmd, changeSet(),
+			                haveDeps ? &deps : nullptr))
+				continue;
+			affected++;
+			metrics->setExpected(uint64_t(affected / progress),
+			                      false);
+			return true;
+		}
+		// each worker gets here after its last command, the last one
+		// sets the final count
+		metrics->setExpected(affected, true);
+		return false;
+	}
+
+	void prefetch(const tooling::CompileCommand &cmd,
+	              const std::vector<std::string> &deps) {
+		auto main = resolve(cmd.Directory, cmd.Filename);
+		if (prefetched.insert(main).second)
+			prefetchFile(main);
+		for (auto &file : deps) {
+			if (prefetched.insert(file).second)
+				prefetchFile(file);
+		}
+	}
+
+	void runReadAhead() {
+		tooling::CompileCommand cmd;
+		std::vector<std::string> deps;
+		while (read(cmd, deps)) {
+			prefetch(cmd, deps);
+			std::unique_lock<std::mutex> guard(lock);
+			changed.wait(guard, [&] { return queue.size() < capacity; });
+			queue.push_back(std::move(cmd));
+			changed.notify_all();
+		}
+		std::lock_guard<std::mutex> guard(lock);
+		finished = true;
+		changed.notify_all();
+	}
+
+      public:
+	std::atomic<unsigned> total{0}, affected{0};
+
+	CommandPipeline(CompileCommandsReader &reader, unsigned capacity)
+	    : reader(reader), capacity(capacity) {
+		auto command = std::make_unique<StreamedCommand>();
+		streamed = command.get();
+		adjusted = tooling::inferTargetAndDriverMode(
+		    tooling::expandResponseFiles(std::move(command),
+		                                 vfs::getRealFileSystem()));
+		if (capacity)
+			readAhead = std::thread([this] { runReadAhead(); });
+	}
+
+	~CommandPipeline() {
+		if (readAhead.joinable())
+			readAhead.join();
+	}
+
+	bool next(tooling::CompileCommand &cmd) {
+		if (!capacity) {
+			std::vector<std::string> deps;
+			return read(cmd, deps);
+		}
+		std::unique_lock<std::mutex> guard(lock);
+		changed.wait(guard, [&] { return !queue.empty() || finished; });
+		if (queue.empty())
+			return false;
+		cmd = std::move(queue.front());
+		queue.pop_front();
+		changed.notify_all();
+		return true;
+	}
+};
+
+// Like runCommands(), but the workers pull commands from the reader as
+// they go instead of waiting for the whole database to be parsed.
+static int runStream(CompileCommandsReader &reader) {
+	std::atomic<int> failed(0);
+	CommandPipeline pipeline(reader, prefetchDepth);
+	{
+		ThreadPool pool(hardware_concurrency(jobs));
+		// -j 0 is one worker per core
+		for (unsigned i = 0; i < pool.getThreadCount(); i++) {
+			pool.async([&] {
+				tooling::CompileCommand cmd;
+				while (pipeline.next(cmd)) {
+					if (!runTU(cmd)) {
+						std::lock_guard<std::mutex> guard(
+						    outputLock);
+						clearProgress();
+						errs() << "rcs-batch: failed to analyze "
+						       << cmd.Filename << "\n";
+						failed++;
+					}
+				}
+			});
+		}
+	}
+	if (!reader.getError().empty()) {
+		errs() << "rcs-batch: compile_commands.json: "
+		       << reader.getError() << "\n";
+		failed++;
+	}
+	if (!changedFiles.empty()) {
+		errs() << "rcs-batch: " << pipeline.affected.load() << " of "
+		       << pipeline.total.load() << " translation units affected\n";
+	}
+	return failed;
+}
+
+// Packs the main files of `commands` and the files listed in their
+// dependency files, which are all the files their compilation reads.
+static int runPack(StringRef path,
+                   const std::vector<tooling::CompileCommand> &commands) {
+	std::vector<std::string> files;
+	unsigned withoutDeps = 0;
+	for (auto &cmd : commands) {
+		files.push_back(resolve(cmd.Directory, cmd.Filename));
+		auto depFile = depFilePath(cmd);
+		if (depFile.empty() || !readDepFile(depFile, cmd.Directory, files))
+			withoutDeps++;
+	}
+	if (withoutDeps) {
+		errs() << "rcs-batch: " << withoutDeps
+		       << " translation units have no dependency file, only "
+		          "their main file is packed\n";
+	}
+	std::string error;
+	std::vector<std::string> missing;
+	bool written = writeSnapshot(path, std::move(files), missing, error);
+	// stale dependency files list headers that were removed since
+	for (auto &file : missing) {
+		errs() << "rcs-batch: warning: " << file
+		       << " no longer exists, it is not packed\n";
+	}
+	if (!written) {
+		errs() << "rcs-batch: " << error << "\n";
+		return 1;
+	}
+	return 0;
+}
+
+// Sharded runs.
+//
+// The coordinator clears the shards of an earlier run from the shared
+// directory and writes:
+//
+//   manifest                       run id, shard count and checker options
+//   changed-lines                  the -changed-files set, if any
+//   shard-<k>/compile_commands.json
+//
+// A worker claims shard k by creating shard-<k>/claimed (exclusive
+// create, so each shard is taken once even across machines), analyzes it
+// and renames its results into shard-<k>/result.bin. The coordinator
+// waits for all results and merges them. Results carry the run id, so
+// those of a worker left over from an earlier run are never merged.
+//
+// result.bin, little endian:
+//
+//   "RCSR0005"
+//   str run id
+//   u32 failed TUs
+//   u32 n, n x (u64 hash, str text, u32 count)             findings
+//   u32 n, n x (u64 hash, str name, str location,
+//               u32 definingUnits, u32 foreignReferences,
+//               str module, u8 exported)                  summaries
+//   u32 n, n x (u64 key, str name, str location, u8 usedInHeaders,
+//               str mainFile, u8 otherMainFiles)           header globals
+//
+// where str is a u32 length followed by the bytes.
+
+static const char resultMagic[] = "RCSR0005";
+
+// set by the coordinator, read from the manifest by workers
+static std::string runId;
+
+static std::string shardPath(StringRef dir, unsigned shard, StringRef file) {
+	SmallString<256> path(dir);
+	sys::path::append(path, "shard-" + std::to_string(shard), file);
+	return path.str().str();
+}
+
+static std::string manifestPath(StringRef dir) {
+	SmallString<256> path(dir);
+	sys::path::append(path, "manifest");
+	return path.str().str();
+}
+
+// Assigns TUs to shards, longest first onto the least loaded shard, with
+// the main file size as cost. Ties are broken by a hash of the TU, so the
+// result only depends on the database.
+static std::vector<std::vector<tooling::CompileCommand>>
+shardCommands(const std::vector<tooling::CompileCommand> &commands,
+              unsigned shards) {
+	struct Job {
+		uint64_t cost;
+		uint64_t hash;
+		const tooling::CompileCommand *cmd;
+	};
+	std::vector<Job> sorted;
+	for (auto &cmd : commands) {
+		uint64_t size = 0;
+		sys::fs::file_size(resolve(cmd.Directory, cmd.Filename), size);
+		sorted.push_back(
+		    {size, xxHash64(cmd.Directory + "\n" + cmd.Filename + "\n" +
+		                    cmd.Output),
+		     &cmd});
+	}
+	std::sort(sorted.begin(), sorted.end(), [](const Job &a, const Job &b) {
+		return a.cost != b.cost ? a.cost > b.cost : a.hash < b.hash;
+	});
+
+	std::vector<std::vector<tooling::CompileCommand>> result(shards);
+	std::vector<uint64_t> load(shards);
+	for (auto &job : sorted) {
+		auto lightest = std::min_element(load.begin(), load.end()) -
+		                load.begin();
+		result[lightest].push_back(*job.cmd);
+		// every TU costs something even if its size is unknown
+		load[lightest] += job.cost + 1;
+	}
+	return result;
+}
+
+static bool writeCompileCommands(StringRef path,
+                                 ArrayRef<tooling::CompileCommand> commands) {
+	std::error_code ec;
+	raw_fd_ostream os(path, ec);
+	if (ec)
+		return false;
+	json::OStream json(os, 2);
+	json.array([&] {
+		for (auto &cmd : commands) {
+			json.object([&] {
+				json.attribute("directory", cmd.Directory);
+				json.attribute("file", cmd.Filename);
+				json.attributeBegin("arguments");
+				json.array([&] {
+					for (auto &arg : cmd.CommandLine)
+						json.value(arg);
+				});
+				json.attributeEnd();
+				if (!cmd.Output.empty())
+					json.attribute("output", cmd.Output);
+			});
+		}
+	});
+	return true;
+}
+
+static void writeString(raw_ostream &os, StringRef str) {
+	support::endian::write<uint32_t>(os, str.size(), support::little);
+	os << str;
+}
+
+static bool writeResults(StringRef path, unsigned failed) {
+	std::string tmp = path.str() + ".tmp";
+	{
+		std::error_code ec;
+		raw_fd_ostream os(tmp, ec);
+		if (ec)
+			return false;
+		os << resultMagic;
+		writeString(os, runId);
+		support::endian::write<uint32_t>(os, failed, support::little);
+		support::endian::write<uint32_t>(os, findings.size(),
+		                                 support::little);
+		findings.forEach([&](uint64_t hash, const Finding &finding) {
+			support::endian::write<uint64_t>(os, hash,
+			                                 support::little);
+			writeString(os, finding.text);
+			support::endian::write<uint32_t>(os, finding.count,
+			                                 support::little);
+		});
+		support::endian::write<uint32_t>(os, summaries.size(),
+		                                 support::little);
+		summaries.forEach([&](uint64_t hash,
+		                      const ProgramSummary &summary) {
+			support::endian::write<uint64_t>(os, hash,
+			                                 support::little);
+			writeString(os, summary.name);
+			writeString(os, summary.location);
+			support::endian::write<uint32_t>(
+			    os, summary.definingUnits, support::little);
+			support::endian::write<uint32_t>(
+			    os, summary.foreignReferences, support::little);
+			writeString(os, summary.module);
+			os << char(summary.exported);
+		});
+		support::endian::write<uint32_t>(os, headerGlobalTable.size(),
+		                                 support::little);
+		headerGlobalTable.forEach([&](uint64_t key,
+		                              const HeaderGlobal &global) {
+			support::endian::write<uint64_t>(os, key, support::little);
+			writeString(os, global.name);
+			writeString(os, global.location);
+			os << char(global.usedInHeaders);
+			writeString(os, global.mainFile);
+			os << char(global.otherMainFiles);
+		});
+		if (os.has_error())
+			return false;
+	}
+	// the coordinator only ever sees complete results
+	return !sys::fs::rename(tmp, path);
+}
+
+// Bounds checked reader over a result file.
+class ResultReader {
+      private:
+	StringRef data;
+	bool ok = true;
+
+      public:
+	explicit ResultReader(StringRef data) : data(data) {}
+
+	bool valid() const { return ok; }
+
+	template <typename T> T read() {
+		if (data.size() < sizeof(T)) {
+			ok = false;
+			return 0;
+		}
+		auto value = support::endian::read<T, support::little, 1>(
+		    data.data());
+		data = data.drop_front(sizeof(T));
+		return value;
+	}
+
+	std::string readString() {
+		auto size = read<uint32_t>();
+		if (data.size() < size) {
+			ok = false;
+			return "";
+		}
+		auto str = data.take_front(size).str();
+		data = data.drop_front(size);
+		return str;
+	}
+
+	bool expect(StringRef magic) {
+		ok = ok && data.startswith(magic);
+		data = data.drop_front(std::min(data.size(), magic.size()));
+		return ok;
+	}
+};
+
+static bool mergeResults(StringRef path, unsigned &failed) {
+	auto buffer = MemoryBuffer::getFile(path);
+	if (!buffer)
+		return false;
+	ResultReader reader((*buffer)->getBuffer());
+	if (!reader.expect(resultMagic) || reader.readString() != runId)
+		return false;
+	failed += reader.read<uint32_t>();
+	auto count = reader.read<uint32_t>();
+	for (uint32_t i = 0; i < count && reader.valid(); i++) {
+		auto hash = reader.read<uint64_t>();
+		Finding finding;
+		finding.text = reader.readString();
+		finding.count = reader.read<uint32_t>();
+		findings.insert(hash, finding);
+	}
+	count = reader.read<uint32_t>();
+	for (uint32_t i = 0; i < count && reader.valid(); i++) {
+		auto hash = reader.read<uint64_t>();
+		ProgramSummary summary;
+		summary.name = reader.readString();
+		summary.location = reader.readString();
+		summary.definingUnits = reader.read<uint32_t>();
+		summary.foreignReferences = reader.read<uint32_t>();
+		summary.module = reader.readString();
+		summary.exported = reader.read<uint8_t>();
+		summaries.insert(hash, summary);
+	}
+	count = reader.read<uint32_t>();
+	for (uint32_t i = 0; i < count && reader.valid(); i++) {
+		auto key = reader.read<uint64_t>();
+		HeaderGlobal global;
+		global.name = reader.readString();
+		global.location = reader.readString();
+		global.usedInHeaders = reader.read<uint8_t>();
+		global.mainFile = reader.readString();
+		global.otherMainFiles = reader.read<uint8_t>();
+		headerGlobalTable.insert(key, global);
+	}
+	return reader.valid();
+}
+
+static bool writeManifest(StringRef dir) {
+	std::error_code ec;
+	raw_fd_ostream os(manifestPath(dir), ec);
+	if (ec)
+		return false;
+	os << "run " << runId << "\n";
+	os << "shards " << shardCount << "\n";
+	if (!changedFiles.empty()) {
+		os << "changed-lines 1\n";
+	}
+	os << "whole-program " << (wholeProgram ? 1 : 0) << "\n";
+	os << "header-globals " << (headerGlobals ? 1 : 0) << "\n";
+	if (!headerCacheDir.empty()) {
+		os << "header-cache " << headerCacheDir << "\n";
+	}
+	for (auto &arg : pluginArgs) {
+		os << "plugin-arg " << arg << "\n";
+	}
+	return !os.has_error();
+}
+
+// Also sets the driver options given to the coordinator.
+static bool readManifest(StringRef dir, unsigned &shards,
+                         std::vector<std::string> &args,
+                         bool &changedLines) {
+	auto buffer = MemoryBuffer::getFile(manifestPath(dir));
+	if (!buffer)
+		return false;
+	SmallVector<StringRef, 16> lines;
+	(*buffer)->getBuffer().split(lines, '\n', -1, false);
+	shards = 0;
+	changedLines = false;
+	for (auto line : lines) {
+		auto entry = line.split(' ');
+		if (entry.first == "run")
+			runId = entry.second.str();
+		else if (entry.first == "changed-lines")
+			changedLines = entry.second == "1";
+		else if (entry.first == "shards")
+			entry.second.getAsInteger(10, shards);
+		else if (entry.first == "whole-program")
+			wholeProgram = entry.second == "1";
+		else if (entry.first == "header-globals")
+			headerGlobals = entry.second == "1";
+		else if (entry.first == "header-cache")
+			headerCacheDir = entry.second.str();
+		else if (entry.first == "plugin-arg")
+			args.push_back(entry.second.str());
+	}
+	return shards > 0;
+}
+
+// run id of the manifest currently in `dir`, empty if there is none
+static std::string currentRunId(StringRef dir) {
+	auto buffer = MemoryBuffer::getFile(manifestPath(dir));
+	if (!buffer)
+		return "";
+	auto first = (*buffer)->getBuffer().split('\n').first.split(' ');
+	return first.first == "run" ? first.second.str() : "";
+}
+
+static int runWorker(StringRef dir) {
+	unsigned shards;
+	std::vector<std::string> args;
+	bool changedLines;
+	if (!readManifest(dir, shards, args, changedLines)) {
+		errs() << "rcs-batch: no coordinator manifest in " << dir << "\n";
+		return 1;
+	}
+	parseArgs(args);
+	installHooks();
+	collectFindingsOnly = true;
+	if (changedLines) {
+		SmallString<256> path(dir);
+		sys::path::append(path, "changed-lines");
+		std::string error;
+		if (!changeSet().load(path, error)) {
+			errs() << "rcs-batch: " << error << "\n";
+			return 1;
+		}
+	}
+
+	for (unsigned shard = 0; shard < shards; shard++) {
+		// a new run was started in the directory, its shards aren't ours
+		if (currentRunId(dir) != runId)
+			break;
+		std::error_code ec;
+		{
+			raw_fd_ostream claim(shardPath(dir, shard, "claimed"), ec,
+			                     sys::fs::CD_CreateNew);
+			if (ec)
+				continue;
+			claim << runId << " " << sys::Process::getProcessId()
+			      << "\n";
+		}
+		std::string error;
+		auto database = tooling::CompilationDatabase::loadFromDirectory(
+		    shardPath(dir, shard, ""), error);
+		if (!database) {
+			errs() << "rcs-batch: " << error << "\n";
+			return 1;
+		}
+		auto failed = runCommands(database->getAllCompileCommands());
+		if (!writeResults(shardPath(dir, shard, "result.bin"), failed)) {
+			errs() << "rcs-batch: cannot write results of shard "
+			       << shard << "\n";
+			return 1;
+		}
+		findings.clear();
+		summaries.clear();
+		headerGlobalTable.clear();
+	}
+	return 0;
+}
+
+static int runCoordinator(StringRef dir, const char *argv0,
+                          const std::vector<tooling::CompileCommand> &commands) {
+	if (shardCount == 0) {
+		errs() << "rcs-batch: -shards must be at least 1\n";
+		return 1;
+	}
+	// The manifest goes first so that no worker starts on the old run,
+	// then the shards with their claims and results.
+	sys::fs::remove(manifestPath(dir));
+	std::error_code ec;
+	for (sys::fs::directory_iterator it(dir, ec), end; it != end && !ec;
+	     it.increment(ec)) {
+		if (sys::path::filename(it->path()).startswith("shard-"))
+			sys::fs::remove_directories(it->path());
+	}
+	runId = utohexstr(
+	    xxHash64(dir.str() + "\n" +
+	             std::to_string(sys::Process::getProcessId()) + "\n" +
+	             std::to_string(std::chrono::system_clock::now()
+	                                .time_since_epoch()
+	                                .count())));
+	if (!changedFiles.empty()) {
+		SmallString<256> path(dir);
+		sys::path::append(path, "changed-lines");
+		raw_fd_ostream os(path, ec);
+		if (!ec)
+			changeSet().write(os);
+		if (ec || os.has_error()) {
+			errs() << "rcs-batch: cannot write " << path << "\n";
+			return 1;
+		}
+	}
+
+	auto shards = shardCommands(commands, shardCount);
+	for (unsigned shard = 0; shard < shardCount; shard++) {
+		auto ec = sys::fs::create_directories(shardPath(dir, shard, ""));
+		if (ec || !writeCompileCommands(
+		              shardPath(dir, shard, "compile_commands.json"),
+		              shards[shard])) {
+			errs() << "rcs-batch: cannot write shard " << shard
+			       << " in " << dir << "\n";
+			return 1;
+		}
+	}
+	// written last, workers don't start before the shards are complete
+	if (!writeManifest(dir)) {
+		errs() << "rcs-batch: cannot write manifest in " << dir << "\n";
+		return 1;
+	}
+
+	auto self = sys::fs::getMainExecutable(argv0, (void *)&runCoordinator);
+	std::string jobsArg = "-j=" + std::to_string(jobs);
+	std::string workerArg = "-worker=" + dir.str();
+	std::vector<sys::ProcessInfo> workers;
+	std::string snapshotArg = "-snapshot=" + snapshotPath;
+	for (unsigned i = 0; i < spawnWorkers; i++) {
+		SmallVector<StringRef, 4> args = {self, workerArg, jobsArg};
+		if (haveSnapshot)
+			args.push_back(snapshotArg);
+		std::string error;
+		workers.push_back(sys::ExecuteNoWait(self, args, None, {}, 0, &error));
+		if (workers.back().Pid == 0) {
+			errs() << "rcs-batch: cannot start worker: " << error << "\n";
+			return 1;
+		}
+	}
+	for (auto &worker : workers) {
+		sys::Wait(worker, 0, true);
+	}
+
+	unsigned failed = 0;
+	for (unsigned shard = 0; shard < shardCount; shard++) {
+		auto result = shardPath(dir, shard, "result.bin");
+		auto claim = shardPath(dir, shard, "claimed");
+		// without local workers, wait for the ones started elsewhere
+		while (workers.empty() && !sys::fs::exists(result)) {
+			sys::fs::file_status status;
+			if (!sys::fs::status(claim, status) &&
+			    std::chrono::system_clock::now() -
+			            status.getLastModificationTime() >
+			        std::chrono::seconds(shardTimeout)) {
+				errs() << "rcs-batch: no results for shard "
+				       << shard << " after " << shardTimeout
+				       << "s, its worker may have died\n";
+				return 1;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+		if (!mergeResults(result, failed)) {
+			errs() << "rcs-batch: missing or corrupt results for shard "
+			       << shard << "\n";
+			return 1;
+		}
+	}
+
+	// sorted so that the output doesn't depend on the sharding
+	std::vector<const Finding *> merged;
+	findings.forEach([&](uint64_t, const Finding &finding) {
+		merged.push_back(&finding);
+	});
+	std::sort(merged.begin(), merged.end(),
+	          [](const Finding *a, const Finding *b) {
+		          return a->text < b->text;
+	          });
+	for (auto finding : merged) {
+		errs() << finding->text;
+	}
+	if (wholeProgram) {
+		printWholeProgram();
+	}
+	if (headerGlobals) {
+		printHeaderGlobals();
+	}
+	return failed ? 1 : 0;
+}
+
+int main(int argc, const char **argv) {
+	cl::HideUnrelatedOptions(category);
+	cl::ParseCommandLineOptions(argc, argv,
+	                            "Redundant global scope checker, batch mode\n");
+
+	metrics.reset(
+	    new BatchMetrics(hardware_concurrency(jobs).compute_thread_count()));
+	ProgressReporter reporter;
+
+	if (!snapshotPath.empty()) {
+		std::string error;
+		if (!sourceSnapshot.open(snapshotPath, error)) {
+			errs() << "rcs-batch: " << error << "\n";
+			return 1;
+		}
+		haveSnapshot = true;
+	}
+
+	if (!workerDir.empty()) {
+		return runWorker(workerDir);
+	}
+
+	if (buildPath.empty() == astFiles.empty()) {
+		errs() << "rcs-batch: give either -p or -ast\n";
+		return 1;
+	}
+
+	if (!astFiles.empty()) {
+		parseArgs(pluginArgs);
+		int failed = 0;
+		for (auto &file : astFiles) {
+			if (!runASTFile(file)) {
+				errs() << "rcs-batch: cannot load " << file << "\n";
+				failed++;
+			}
+		}
+		return failed ? 1 : 0;
+	}
+
+	parseArgs(pluginArgs);
+	installHooks();
+	std::string error;
+	if (!changedFiles.empty() && !changeSet().load(changedFiles, error)) {
+		errs() << "rcs-batch: " << error << "\n";
+		return 1;
+	}
+
+	// the coordinator needs the whole database up front to balance shards
+	SmallString<256> jsonPath(buildPath);
+	sys::path::append(jsonPath, "compile_commands.json");
+	if (coordinatorDir.empty() && packPath.empty() &&
+	    sys::fs::exists(jsonPath)) {
+		CompileCommandsReader reader;
+		if (!reader.open(jsonPath)) {
+			errs() << "rcs-batch: " << reader.getError() << "\n";
+			return 1;
+		}
+		auto failed = runStream(reader);
+		if (wholeProgram) {
+			printWholeProgram();
+		}
+		if (headerGlobals) {
+			printHeaderGlobals();
+		}
+		return failed ? 1 : 0;
+	}
+
+	auto database =
+	    tooling::CompilationDatabase::loadFromDirectory(buildPath, error);
+	if (!database) {
+		errs() << "rcs-batch: " << error << "\n";
+		return 1;
+	}
+
+	auto commands = database->getAllCompileCommands();
+	if (!changedFiles.empty()) {
+		std::vector<tooling::CompileCommand> affected;
+		for (auto &cmd : commands) {
+			if (isAffected(cmd, changeSet()))
+				affected.push_back(cmd);
+		}
+		errs() << "rcs-batch: " << affected.size() << " of "
+		       << commands.size() << " translation units affected\n";
+		commands = std::move(affected);
+	}
+
+	if (!packPath.empty()) {
+		return runPack(packPath, commands);
+	}
+
+	if (!coordinatorDir.empty()) {
+		return runCoordinator(coordinatorDir, argv[0], commands);
+	}
+
+	auto failed = runCommands(commands);
+	if (wholeProgram) {
+		printWholeProgram();
+	}
+	if (headerGlobals) {
+		printHeaderGlobals();
+	}
+	return failed ? 1 : 0;
+}
@@ -0,0 +1,152 @@
+#ifndef RESULTS_TABLE_H
+#define RESULTS_TABLE_H
+
+// Concurrent hash table used by rcs-batch to aggregate results reported by
+// its worker threads, keyed by a 64 bit hash (of a global's linkage name,
+// or of a finding's text).
+//
+// The table is split in stripes, each with its own lock and map, selected
+// by the top bits of the key, so that threads only contend when they hit
+// the same stripe. Workers that report many entries go through a
+// StagingBuffer, which batches insertions and takes each stripe lock once
+// per batch. The number of stripes is a parameter: the default of 64 has
+// not been tuned on multi-core hardware, bench/results_table_bench.cc
+// compares stripe counts against a single mutex.
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+template <typename Value> class ConcurrentTable {
+      public:
+	// merges `incoming` into the `existing` entry with the same key
+	using MergeFn = void (*)(Value &existing, const Value &incoming);
+
+	static constexpr unsigned defaultStripeBits = 6;
+
+      private:
+	struct Stripe {
+		std::mutex lock;
+		std::unordered_map<uint64_t, Value> entries;
+		// keep neighbouring locks out of the same cache line
+		char padding[64];
+	};
+
+	unsigned stripeBits;
+	unsigned stripeCount;
+	std::unique_ptr<Stripe[]> stripes;
+	MergeFn merge;
+
+	unsigned stripeOf(uint64_t key) const {
+		return stripeBits ? key >> (64 - stripeBits) : 0;
+	}
+
+	// caller holds the stripe lock
+	bool insertLocked(Stripe &stripe, uint64_t key, const Value &value) {
+		auto result = stripe.entries.emplace(key, value);
+		if (!result.second) {
+			merge(result.first->second, value);
+		}
+		return result.second;
+	}
+
+      public:
+	// 2^stripeBits stripes, at most 2^16
+	explicit ConcurrentTable(MergeFn merge,
+	                         unsigned stripeBits = defaultStripeBits)
+	    : stripeBits(std::min(stripeBits, 16u)),
+	      stripeCount(1u << this->stripeBits),
+	      stripes(new Stripe[stripeCount]), merge(merge) {}
+
+	// Returns true if the key was not in the table yet.
+	bool insert(uint64_t key, const Value &value) {
+		auto &stripe = stripes[stripeOf(key)];
+		std::lock_guard<std::mutex> guard(stripe.lock);
+		return insertLocked(stripe, key, value);
+	}
+
+	// Inserts all of `batch`, locking each stripe at most once. The batch
+	// is reordered.
+	void insertBatch(std::vector<std::pair<uint64_t, Value>> &batch) {
+		std::sort(batch.begin(), batch.end(),
+		          [this](const std::pair<uint64_t, Value> &a,
+		                 const std::pair<uint64_t, Value> &b) {
+			          return stripeOf(a.first) < stripeOf(b.first);
+		          });
+		size_t i = 0;
+		while (i < batch.size()) {
+			auto index = stripeOf(batch[i].first);
+			auto &stripe = stripes[index];
+			std::lock_guard<std::mutex> guard(stripe.lock);
+			for (; i < batch.size() &&
+			       stripeOf(batch[i].first) == index;
+			     i++) {
+				insertLocked(stripe, batch[i].first,
+				             batch[i].second);
+			}
+		}
+	}
+
+	// Only call once all writers are done.
+	template <typename Fn> void forEach(Fn fn) const {
+		for (unsigned i = 0; i < stripeCount; i++) {
+			for (auto &entry : stripes[i].entries) {
+				fn(entry.first, entry.second);
+			}
+		}
+	}
+
+	// Only call while no writers are active.
+	void clear() {
+		for (unsigned i = 0; i < stripeCount; i++) {
+			stripes[i].entries.clear();
+		}
+	}
+
+	size_t size() const {
+		size_t total = 0;
+		for (unsigned i = 0; i < stripeCount; i++) {
+			total += stripes[i].entries.size();
+		}
+		return total;
+	}
+};
+
+// Per thread buffer in front of a ConcurrentTable. Not thread safe itself,
+// each worker owns one. Flushes when full and when destroyed.
+template <typename Value> class StagingBuffer {
+      private:
+	ConcurrentTable<Value> &table;
+	std::vector<std::pair<uint64_t, Value>> pending;
+	size_t batchSize;
+
+      public:
+	explicit StagingBuffer(ConcurrentTable<Value> &table,
+	                       size_t batchSize = 256)
+	    : table(table), batchSize(batchSize) {
+		pending.reserve(batchSize);
+	}
+	StagingBuffer(const StagingBuffer &) = delete;
+	StagingBuffer &operator=(const StagingBuffer &) = delete;
+	~StagingBuffer() { flush(); }
+
+	void add(uint64_t key, Value value) {
+		pending.emplace_back(key, std::move(value));
+		if (pending.size() >= batchSize) {
+			flush();
+		}
+	}
+
+	void flush() {
+		if (pending.empty())
+			return;
+		table.insertBatch(pending);
+		pending.clear();
+	}
+};
+
+#endif
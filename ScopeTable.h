@@ -0,0 +1,87 @@
+#ifndef SCOPE_TABLE_H
+#define SCOPE_TABLE_H
+
+// The scope engine behind the redundant scope check. For each global it
+// keeps the uses seen so far, and as the traversal leaves a block it
+// merges the uses inside the block into one entry for the block. A global
+// whose uses end up in a single entry is only used in that block.
+//
+// The node types are parameters so that rcs-replay can drive the engine
+// from a recorded trace without clang. The plugin uses VarDecl, Stmt and
+// CompoundStmt. `Scope` must convert to `Use`: a merged entry stands for
+// its block.
+
+#include <unordered_map>
+#include <vector>
+
+#include "llvm/ADT/DenseMap.h"
+#include "llvm/ADT/SmallVector.h"
+
+template <typename Use, typename Scope> struct ScopeUsage {
+	Use *usedIn;
+	Scope *parent;
+	std::vector<ScopeUsage> children;
+};
+
+template <typename Decl, typename Use, typename Scope> struct ScopeTable {
+	using Usage = ScopeUsage<Use, Scope>;
+
+	std::unordered_map<Decl *, std::vector<Usage>> usages;
+	std::vector<Decl *> globals;
+
+	// globals with a usage whose parent is the key, only those need to
+	// be merged when leaving that block
+	llvm::DenseMap<Scope *, llvm::SmallVector<Decl *, 4>> touched;
+
+	void touch(Scope *scope, Decl *decl) {
+		// nothing is merged above the outermost block
+		if (scope == nullptr)
+			return;
+		auto &decls = touched[scope];
+		if (decls.empty() || decls.back() != decl)
+			decls.push_back(decl);
+	}
+
+	bool isTracked(Decl *decl) const { return usages.count(decl); }
+
+	void add(Decl *decl) {
+		globals.push_back(decl);
+		usages[decl] = {};
+	}
+
+	void addUse(Decl *decl, Use *use, Scope *scope) {
+		usages[decl].push_back(Usage{use, scope, {}});
+		touch(scope, decl);
+	}
+
+	// merges all children of `compound` in vector under `compound`
+	void merge(std::vector<Usage> &v, Scope *compound, Scope *parent) {
+		typename std::vector<Usage>::iterator itr;
+		for (itr = v.begin(); itr != v.end(); itr++) {
+			if (itr->parent == compound)
+				break;
+		}
+		if (itr == v.end()) {
+			return;
+		}
+		// merge [itr, end) into one Usage
+		*itr = Usage{compound, parent,
+		             std::vector<Usage>(itr, v.end())};
+		v.erase(itr + 1, v.end());
+	}
+
+	void mergeAll(Scope *stmt, Scope *parent) {
+		auto entry = touched.find(stmt);
+		if (entry == touched.end()) {
+			return;
+		}
+		auto decls = std::move(entry->second);
+		touched.erase(entry);
+		for (auto decl : decls) {
+			merge(usages[decl], stmt, parent);
+			touch(parent, decl);
+		}
+	}
+};
+
+#endif
@@ -0,0 +1,402 @@
+#ifndef SNAPSHOT_FILE_SYSTEM_H
+#define SNAPSHOT_FILE_SYSTEM_H
+
+// Source snapshots: a whole tree packed into one indexed file, so that CI
+// can ship it to workers as a single file instead of unpacking many small
+// ones. rcs-batch memory maps the snapshot and serves sources and headers
+// straight from the mapping through SnapshotFileSystem.
+//
+// Layout, little endian:
+//
+//   "RCSP0001"
+//   file contents, each followed by a '\0'
+//   paths, each followed by a '\0'
+//   n x (u64 path offset, u64 path size, u64 data offset, u64 data size)
+//   u64 offset of the index
+//   u64 n
+//
+// Offsets are from the start of the file. Paths are absolute and sorted,
+// so lookups are a binary search over the index and the files of a
+// directory are contiguous. The '\0' after each file lets clang use the
+// mapped bytes as null terminated buffers without copying them.
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <string>
+#include <tuple>
+#include <vector>
+
+#include "llvm/ADT/SmallString.h"
+#include "llvm/ADT/StringRef.h"
+#include "llvm/Support/Endian.h"
+#include "llvm/Support/EndianStream.h"
+#include "llvm/Support/FileSystem.h"
+#include "llvm/Support/MemoryBuffer.h"
+#include "llvm/Support/Path.h"
+#include "llvm/Support/VirtualFileSystem.h"
+#include "llvm/Support/raw_ostream.h"
+#include "llvm/Support/xxhash.h"
+
+static const char snapshotMagic[] = "RCSP0001";
+
+// Read only view of a mapped snapshot, shared by all threads.
+class Snapshot {
+      private:
+	std::unique_ptr<llvm::MemoryBuffer> buffer;
+	const char *index = nullptr;
+	uint64_t count = 0;
+	// UniqueID device of the snapshot's files
+	uint64_t device = 0;
+
+	static constexpr size_t entrySize = 4 * sizeof(uint64_t);
+	static constexpr size_t trailerSize = 2 * sizeof(uint64_t);
+
+	static uint64_t read64(const char *p) {
+		return llvm::support::endian::read<uint64_t, llvm::support::little,
+		                                   1>(p);
+	}
+
+	uint64_t field(uint64_t i, unsigned n) const {
+		return read64(index + i * entrySize + n * sizeof(uint64_t));
+	}
+
+	const char *start() const { return buffer->getBufferStart(); }
+
+	// first entry whose path is not less than `path`
+	uint64_t lowerBound(llvm::StringRef path) const {
+		uint64_t low = 0, high = count;
+		while (low < high) {
+			uint64_t middle = low + (high - low) / 2;
+			if (pathAt(middle) < path)
+				low = middle + 1;
+			else
+				high = middle;
+		}
+		return low;
+	}
+
+      public:
+	// Maps the snapshot and checks that every entry is in bounds, so
+	// later lookups don't have to.
+	bool open(llvm::StringRef path, std::string &error) {
+		auto file = llvm::MemoryBuffer::getFile(path, -1, false);
+		if (!file) {
+			error = "cannot read " + path.str() + ": " +
+			        file.getError().message();
+			return false;
+		}
+		buffer = std::move(*file);
+		error = path.str() + " is not a valid snapshot";
+		size_t size = buffer->getBufferSize();
+		size_t header = sizeof(snapshotMagic) - 1;
+		if (size < header + trailerSize ||
+		    !buffer->getBuffer().startswith(snapshotMagic))
+			return false;
+		uint64_t indexOffset = read64(start() + size - trailerSize);
+		count = read64(start() + size - sizeof(uint64_t));
+		if (indexOffset < header || indexOffset > size - trailerSize ||
+		    count > (size - trailerSize - indexOffset) / entrySize)
+			return false;
+		index = start() + indexOffset;
+		for (uint64_t i = 0; i < count; i++) {
+			for (unsigned n = 0; n < 4; n += 2) {
+				uint64_t offset = field(i, n), length = field(i, n + 1);
+				// the terminator is part of the entry
+				if (offset < header || offset > indexOffset ||
+				    length >= indexOffset - offset ||
+				    start()[offset + length] != '\0')
+					return false;
+			}
+			if (i > 0 && !(pathAt(i - 1) < pathAt(i)))
+				return false;
+		}
+		device = llvm::xxHash64(path);
+		error.clear();
+		return true;
+	}
+
+	uint64_t size() const { return count; }
+
+	llvm::StringRef pathAt(uint64_t i) const {
+		return llvm::StringRef(start() + field(i, 0), field(i, 1));
+	}
+
+	// Contents of the i-th file, followed by a '\0' outside of the ref.
+	llvm::StringRef dataAt(uint64_t i) const {
+		return llvm::StringRef(start() + field(i, 2), field(i, 3));
+	}
+
+	// Index of the file at the absolute, normalized `path`, or size().
+	uint64_t find(llvm::StringRef path) const {
+		uint64_t i = lowerBound(path);
+		return i < count && pathAt(i) == path ? i : count;
+	}
+
+	// A directory exists if it contains at least one file.
+	bool isDirectory(llvm::StringRef path) const {
+		auto prefix = directoryPrefix(path);
+		uint64_t i = lowerBound(prefix);
+		return i < count && pathAt(i).startswith(prefix);
+	}
+
+	// Range of entries inside directory `path`, at any depth.
+	std::pair<uint64_t, uint64_t> directoryRange(llvm::StringRef path) const {
+		auto prefix = directoryPrefix(path);
+		uint64_t first = lowerBound(prefix), last = first;
+		while (last < count && pathAt(last).startswith(prefix))
+			last++;
+		return {first, last};
+	}
+
+	static std::string directoryPrefix(llvm::StringRef path) {
+		std::string prefix = path.str();
+		if (!llvm::sys::path::is_separator(prefix.back()))
+			prefix += '/';
+		return prefix;
+	}
+
+	// Statuses are named `name`, the path as the caller gave it, like
+	// the real file system does.
+	llvm::vfs::Status fileStatus(uint64_t i, llvm::StringRef name) const {
+		return llvm::vfs::Status(
+		    name, llvm::sys::fs::UniqueID(device, i),
+		    llvm::sys::TimePoint<>(), 0, 0, dataAt(i).size(),
+		    llvm::sys::fs::file_type::regular_file,
+		    llvm::sys::fs::perms::all_read);
+	}
+
+	llvm::vfs::Status directoryStatus(llvm::StringRef path,
+	                                  llvm::StringRef name) const {
+		return llvm::vfs::Status(
+		    name, llvm::sys::fs::UniqueID(device, directoryId(path)),
+		    llvm::sys::TimePoint<>(), 0, 0, 0,
+		    llvm::sys::fs::file_type::directory_file,
+		    llvm::sys::fs::perms::all_read | llvm::sys::fs::perms::all_exe);
+	}
+
+      private:
+	// files use their index, which is below 2^63
+	static uint64_t directoryId(llvm::StringRef path) {
+		return llvm::xxHash64(path) | (1ull << 63);
+	}
+};
+
+// File system over a Snapshot, falling back to `fallback` (normally the
+// real file system) for paths the snapshot doesn't contain, e.g. system
+// headers that weren't packed. Each translation unit gets its own
+// instance, for its working directory; the snapshot itself is shared.
+//
+// Paths are made absolute against this file system's working directory
+// before they reach the fallback, so the directory doesn't have to exist
+// on disk. A directory present in the snapshot is listed from the
+// snapshot only.
+class SnapshotFileSystem : public llvm::vfs::FileSystem {
+      private:
+	const Snapshot &snapshot;
+	llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fallback;
+	std::string workingDirectory;
+
+	class SnapshotFile : public llvm::vfs::File {
+	      private:
+		const Snapshot &snapshot;
+		uint64_t entry;
+		std::string name;
+
+	      public:
+		SnapshotFile(const Snapshot &snapshot, uint64_t entry,
+		             std::string name)
+		    : snapshot(snapshot), entry(entry), name(std::move(name)) {}
+
+		llvm::ErrorOr<llvm::vfs::Status> status() override {
+			return snapshot.fileStatus(entry, name);
+		}
+
+		llvm::ErrorOr<std::unique_ptr<llvm::MemoryBuffer>>
+		getBuffer(const llvm::Twine &name, int64_t, bool nullTerminated,
+		          bool) override {
+			// no copy, the '\0' after the data terminates it
+			return llvm::MemoryBuffer::getMemBuffer(
+			    snapshot.dataAt(entry), name.str(), nullTerminated);
+		}
+
+		std::error_code close() override { return {}; }
+	};
+
+	// Lists the direct children of a directory from the sorted entries
+	// below it, skipping over the contents of subdirectories.
+	class SnapshotDirIterator : public llvm::vfs::detail::DirIterImpl {
+	      private:
+		const Snapshot &snapshot;
+		std::string prefix;
+		uint64_t next, last;
+
+	      public:
+		SnapshotDirIterator(const Snapshot &snapshot,
+		                    llvm::StringRef directory)
+		    : snapshot(snapshot),
+		      prefix(Snapshot::directoryPrefix(directory)) {
+			std::tie(next, last) = snapshot.directoryRange(directory);
+			increment();
+		}
+
+		std::error_code increment() override {
+			if (next >= last) {
+				CurrentEntry = llvm::vfs::directory_entry();
+				return {};
+			}
+			auto path = snapshot.pathAt(next);
+			auto child = path.drop_front(prefix.size());
+			auto slash = child.find('/');
+			if (slash == llvm::StringRef::npos) {
+				CurrentEntry = llvm::vfs::directory_entry(
+				    path.str(), llvm::sys::fs::file_type::regular_file);
+				next++;
+				return {};
+			}
+			auto subdirectory =
+			    path.take_front(prefix.size() + slash).str();
+			CurrentEntry = llvm::vfs::directory_entry(
+			    subdirectory, llvm::sys::fs::file_type::directory_file);
+			subdirectory += '/';
+			while (next < last &&
+			       snapshot.pathAt(next).startswith(subdirectory))
+				next++;
+			return {};
+		}
+	};
+
+	std::string absolute(const llvm::Twine &path) const {
+		llvm::SmallString<256> result;
+		path.toVector(result);
+		llvm::sys::fs::make_absolute(workingDirectory, result);
+		llvm::sys::path::remove_dots(result, true);
+		return result.str().str();
+	}
+
+      public:
+	SnapshotFileSystem(const Snapshot &snapshot,
+	                   llvm::IntrusiveRefCntPtr<llvm::vfs::FileSystem> fallback)
+	    : snapshot(snapshot), fallback(std::move(fallback)) {
+		if (auto cwd = this->fallback->getCurrentWorkingDirectory())
+			workingDirectory = *cwd;
+	}
+
+	llvm::ErrorOr<llvm::vfs::Status> status(const llvm::Twine &path) override {
+		auto resolved = absolute(path);
+		auto entry = snapshot.find(resolved);
+		if (entry < snapshot.size())
+			return snapshot.fileStatus(entry, path.str());
+		if (snapshot.isDirectory(resolved))
+			return snapshot.directoryStatus(resolved, path.str());
+		auto result = fallback->status(resolved);
+		if (!result)
+			return result;
+		return llvm::vfs::Status::copyWithNewName(*result, path.str());
+	}
+
+	llvm::ErrorOr<std::unique_ptr<llvm::vfs::File>>
+	openFileForRead(const llvm::Twine &path) override {
+		auto resolved = absolute(path);
+		auto entry = snapshot.find(resolved);
+		if (entry < snapshot.size())
+			return std::unique_ptr<llvm::vfs::File>(
+			    new SnapshotFile(snapshot, entry, path.str()));
+		return fallback->openFileForRead(resolved);
+	}
+
+	llvm::vfs::directory_iterator dir_begin(const llvm::Twine &path,
+	                                        std::error_code &ec) override {
+		auto resolved = absolute(path);
+		if (snapshot.isDirectory(resolved))
+			return llvm::vfs::directory_iterator(
+			    std::make_shared<SnapshotDirIterator>(snapshot,
+			                                          resolved));
+		return fallback->dir_begin(resolved, ec);
+	}
+
+	llvm::ErrorOr<std::string> getCurrentWorkingDirectory() const override {
+		return workingDirectory;
+	}
+
+	std::error_code setCurrentWorkingDirectory(const llvm::Twine &path) override {
+		workingDirectory = absolute(path);
+		return {};
+	}
+};
+
+// Packs `files` (absolute, normalized paths) into a snapshot at `path`.
+// Written to a temporary file and renamed, so readers never see a partial
+// snapshot. Files that no longer exist, e.g. stale depfile entries, are
+// left out and listed in `missing`.
+inline bool writeSnapshot(llvm::StringRef path, std::vector<std::string> files,
+                          std::vector<std::string> &missing,
+                          std::string &error) {
+	using namespace llvm::support;
+	std::sort(files.begin(), files.end());
+	files.erase(std::unique(files.begin(), files.end()), files.end());
+
+	std::string tmp = path.str() + ".tmp";
+	std::error_code ec;
+	llvm::raw_fd_ostream os(tmp, ec);
+	if (ec) {
+		error = "cannot write " + tmp + ": " + ec.message();
+		return false;
+	}
+	auto discard = [&]() {
+		os.close();
+		os.clear_error();
+		llvm::sys::fs::remove(tmp);
+		return false;
+	};
+	os << snapshotMagic;
+	uint64_t offset = sizeof(snapshotMagic) - 1;
+	std::vector<uint64_t> dataOffsets, dataSizes;
+	std::vector<std::string> packed;
+	for (auto &file : files) {
+		auto buffer = llvm::MemoryBuffer::getFile(file, -1, false);
+		if (buffer.getError() == std::errc::no_such_file_or_directory) {
+			missing.push_back(file);
+			continue;
+		}
+		if (!buffer) {
+			error = "cannot read " + file + ": " +
+			        buffer.getError().message();
+			return discard();
+		}
+		packed.push_back(file);
+		auto data = (*buffer)->getBuffer();
+		os << data << '\0';
+		dataOffsets.push_back(offset);
+		dataSizes.push_back(data.size());
+		offset += data.size() + 1;
+	}
+	files = std::move(packed);
+	std::vector<uint64_t> pathOffsets;
+	for (auto &file : files) {
+		os << file << '\0';
+		pathOffsets.push_back(offset);
+		offset += file.size() + 1;
+	}
+	for (size_t i = 0; i < files.size(); i++) {
+		endian::write<uint64_t>(os, pathOffsets[i], little);
+		endian::write<uint64_t>(os, files[i].size(), little);
+		endian::write<uint64_t>(os, dataOffsets[i], little);
+		endian::write<uint64_t>(os, dataSizes[i], little);
+	}
+	endian::write<uint64_t>(os, offset, little);
+	endian::write<uint64_t>(os, files.size(), little);
+	os.close();
+	if (os.has_error()) {
+		error = "cannot write " + tmp + ": " + os.error().message();
+		return discard();
+	}
+	if (auto ec = llvm::sys::fs::rename(tmp, path)) {
+		error = "cannot write " + path.str() + ": " + ec.message();
+		llvm::sys::fs::remove(tmp);
+		return false;
+	}
+	return true;
+}
+
+#endif
@@ -0,0 +1,155 @@
+// Replays event traces written with -record-events through the scope
+// engine, to benchmark it on real translation units without parsing them.
+//
+// usage: rcs-replay [-engine=table|null] [-repeat=<n>] trace...
+//
+// The table engine is the plugin's ScopeTable, the null engine only
+// decodes the trace, which gives the cost of the replay itself.
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <deque>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "../EventTrace.h"
+#include "../ScopeTable.h"
+#include "llvm/Support/MemoryBuffer.h"
+
+struct TraceGlobal {
+	std::string name;
+};
+
+// stands for a block, or for a reference
+struct TraceNode {};
+
+class Engine : public TraceConsumer {
+      public:
+	uint64_t events = 0;
+	virtual void report() {}
+};
+
+class NullEngine : public Engine {
+      public:
+	void onGlobal(uint32_t, llvm::StringRef) override { events++; }
+	void onReference(uint32_t, uint32_t) override { events++; }
+	void onScopeEnter(uint32_t, uint32_t, unsigned) override { events++; }
+	void onScopeExit(uint32_t, uint32_t) override { events++; }
+};
+
+class TableEngine : public Engine {
+      private:
+	ScopeTable<TraceGlobal, TraceNode, TraceNode> table;
+	// indexed by id, id 0 is unused
+	std::deque<TraceGlobal> globals;
+	std::deque<TraceNode> scopes;
+	// the engine never looks at the node of a reference
+	TraceNode use;
+
+	template <typename T>
+	static T *node(std::deque<T> &nodes, uint32_t id) {
+		if (id == 0)
+			return nullptr;
+		if (id >= nodes.size())
+			nodes.resize(id + 1);
+		return &nodes[id];
+	}
+
+      public:
+	void onGlobal(uint32_t decl, llvm::StringRef name) override {
+		events++;
+		auto global = node(globals, decl);
+		global->name = name.str();
+		table.add(global);
+	}
+
+	void onReference(uint32_t decl, uint32_t scope) override {
+		events++;
+		table.addUse(node(globals, decl), &use, node(scopes, scope));
+	}
+
+	void onScopeEnter(uint32_t scope, uint32_t, unsigned) override {
+		events++;
+		node(scopes, scope);
+	}
+
+	void onScopeExit(uint32_t scope, uint32_t parent) override {
+		events++;
+		table.mergeAll(node(scopes, scope), node(scopes, parent));
+	}
+
+	void report() override {
+		unsigned unused = 0, oneBlock = 0;
+		for (auto &entry : table.usages) {
+			auto &uses = entry.second;
+			unused += uses.empty();
+			oneBlock +=
+			    uses.size() == 1 && !uses[0].children.empty();
+		}
+		printf("  %zu globals, %u unused, %u used in one block\n",
+		       table.usages.size(), unused, oneBlock);
+	}
+};
+
+int main(int argc, char **argv) {
+	std::string engineName = "table";
+	unsigned repeat = 1;
+	std::vector<std::string> traces;
+	for (int i = 1; i < argc; i++) {
+		llvm::StringRef arg = argv[i];
+		if (arg.consume_front("-engine=")) {
+			engineName = arg.str();
+		} else if (arg.consume_front("-repeat=")) {
+			repeat = std::max(atoi(arg.data()), 1);
+		} else {
+			traces.push_back(arg.str());
+		}
+	}
+	if (traces.empty() ||
+	    (engineName != "table" && engineName != "null")) {
+		fprintf(stderr, "usage: rcs-replay [-engine=table|null] "
+		                "[-repeat=<n>] trace...\n");
+		return 2;
+	}
+
+	uint64_t events = 0;
+	double seconds = 0;
+	for (auto &path : traces) {
+		auto file = llvm::MemoryBuffer::getFile(path);
+		if (!file) {
+			fprintf(stderr, "cannot read %s: %s\n", path.c_str(),
+			        file.getError().message().c_str());
+			return 1;
+		}
+		std::unique_ptr<Engine> engine;
+		for (unsigned i = 0; i < repeat; i++) {
+			if (engineName == "table")
+				engine = std::make_unique<TableEngine>();
+			else
+				engine = std::make_unique<NullEngine>();
+			std::string error;
+			auto start = std::chrono::steady_clock::now();
+			bool ok =
+			    replayTrace((*file)->getBuffer(), *engine, error);
+			std::chrono::duration<double> elapsed =
+			    std::chrono::steady_clock::now() - start;
+			if (!ok) {
+				fprintf(stderr, "%s: %s\n", path.c_str(),
+				        error.c_str());
+				return 1;
+			}
+			seconds += elapsed.count();
+			events += engine->events;
+		}
+		printf("%s: %llu events\n", path.c_str(),
+		       (unsigned long long)engine->events);
+		engine->report();
+	}
+	printf("%s engine: %llu events in %.3f s, %.1f M events/s\n",
+	       engineName.c_str(), (unsigned long long)events, seconds,
+	       seconds > 0 ? events / seconds / 1e6 : 0.0);
+	return 0;
+}
@@ -0,0 +1,105 @@
+// Contention benchmark for ConcurrentTable: many threads reporting per
+// global summaries at once, as rcs-batch workers do.
+//
+// usage: results-table-bench [threads] [entries per thread] [stripe bits...]
+//
+// Compares a single mutex protected map, direct striped insertion and
+// striped insertion through per thread staging buffers, for each number
+// of stripes (2^bits, 64 by default). Contention only shows with at least
+// a few cores, so the core count is printed with the results.
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "../ResultsTable.h"
+
+struct Summary {
+	unsigned translationUnits;
+	unsigned references;
+};
+
+static void mergeSummary(Summary &existing, const Summary &incoming) {
+	existing.translationUnits += incoming.translationUnits;
+	existing.references += incoming.references;
+}
+
+// Keys shared between threads, like globals declared in common headers.
+static uint64_t keyFor(unsigned thread, unsigned i) {
+	uint64_t x = (i % 4096) * 0x9E3779B97F4A7C15ull + (i / 4096 + thread % 4);
+	x ^= x >> 31;
+	return x * 0xBF58476D1CE4E5B9ull;
+}
+
+template <typename Fn> static double timeThreads(unsigned threads, Fn fn) {
+	auto start = std::chrono::steady_clock::now();
+	std::vector<std::thread> pool;
+	for (unsigned t = 0; t < threads; t++) {
+		pool.emplace_back(fn, t);
+	}
+	for (auto &thread : pool) {
+		thread.join();
+	}
+	std::chrono::duration<double, std::milli> elapsed =
+	    std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+int main(int argc, char **argv) {
+	unsigned threads = argc > 1 ? atoi(argv[1]) : 64;
+	unsigned perThread = argc > 2 ? atoi(argv[2]) : 200000;
+	std::vector<unsigned> stripeBits;
+	for (int i = 3; i < argc; i++) {
+		stripeBits.push_back(atoi(argv[i]));
+	}
+	if (stripeBits.empty()) {
+		unsigned bits = ConcurrentTable<Summary>::defaultStripeBits;
+		stripeBits.push_back(bits);
+	}
+
+	std::mutex lock;
+	std::unordered_map<uint64_t, Summary> locked;
+	double mutexMs = timeThreads(threads, [&](unsigned t) {
+		for (unsigned i = 0; i < perThread; i++) {
+			std::lock_guard<std::mutex> guard(lock);
+			auto result = locked.emplace(keyFor(t, i), Summary{1, 1});
+			if (!result.second)
+				mergeSummary(result.first->second, {1, 1});
+		}
+	});
+
+	printf("%u threads x %u entries, %zu distinct keys, %u cores\n",
+	       threads, perThread, locked.size(),
+	       std::thread::hardware_concurrency());
+	printf("  single mutex                   %8.1f ms\n", mutexMs);
+
+	bool consistent = true;
+	for (auto bits : stripeBits) {
+		ConcurrentTable<Summary> striped(mergeSummary, bits);
+		double stripedMs = timeThreads(threads, [&](unsigned t) {
+			for (unsigned i = 0; i < perThread; i++) {
+				striped.insert(keyFor(t, i), {1, 1});
+			}
+		});
+
+		ConcurrentTable<Summary> staged(mergeSummary, bits);
+		double stagedMs = timeThreads(threads, [&](unsigned t) {
+			StagingBuffer<Summary> buffer(staged);
+			for (unsigned i = 0; i < perThread; i++) {
+				buffer.add(keyFor(t, i), {1, 1});
+			}
+		});
+
+		printf("  %5u stripes                  %8.1f ms\n", 1u << bits,
+		       stripedMs);
+		printf("  %5u stripes + staging        %8.1f ms\n", 1u << bits,
+		       stagedMs);
+		consistent &= striped.size() == locked.size() &&
+		              staged.size() == locked.size();
+	}
+	return consistent ? 0 : 1;
+}
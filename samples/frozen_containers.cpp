@@ -0,0 +1,51 @@
+#include <map>
+#include <string>
+#include <unordered_map>
+
+// run with -frozen-containers
+
+// only read: a sorted constexpr array
+static std::map<int, int> squares = {{1, 1}, {2, 4}, {3, 9}};
+
+// filled once by initNames(): a perfect hash table
+static std::unordered_map<std::string, int> names;
+
+// modified while running: no warning
+static std::map<std::string, int> counts;
+
+// written through at(): no warning
+static std::map<int, int> limits = {{1, 10}, {2, 20}};
+
+// cleared by reset() while running, not filled by it: no warning
+static std::map<int, int> cache = {{0, 0}};
+
+static void initNames() {
+	names["one"] = 1;
+	names["two"] = 2;
+}
+
+static void doubleLimit(int key) { limits.at(key) *= 2; }
+
+static void reset() { cache.clear(); }
+
+static int lookup(const char *name) {
+	auto found = names.find(name);
+	return found == names.end() ? 0 : found->second;
+}
+
+int main(int argc, char **argv) {
+	initNames();
+	doubleLimit(argc);
+	for (int i = 0; i < argc; i++) {
+		counts[argv[i]]++;
+		reset();
+	}
+	return squares.at(2) + lookup(argv[0]) + (int)cache.size();
+}
+
+// expected:
+// squares is only read after its initialization, note: a sorted
+//   constexpr array would save about 48 bytes per element (144 bytes for
+//   3 elements)
+// names is only read after initNames fills it, note: a perfect hash
+//   table or a sorted array would save about 40 bytes per element
@@ -0,0 +1,57 @@
+#include <map>
+#include <regex>
+#include <string>
+
+// run with -hoist-locals
+
+bool isIdentifier(const std::string &s) {
+	// compiled on every call: static const
+	std::regex identifier("[A-Za-z_][A-Za-z0-9_]*");
+	return std::regex_match(s, identifier);
+}
+
+int weight(const std::string &s) {
+	int total = 0;
+	for (char c : s) {
+		// rebuilt on every iteration: static const, reported first
+		const std::map<char, int> weights = {{'a', 1}, {'b', 2}};
+		auto found = weights.find(c);
+		total += found == weights.end() ? 0 : found->second;
+	}
+	return total;
+}
+
+int count(const std::string &s) {
+	int found = 0;
+	// built once per call, before the loop: ranked as a call, not an
+	// iteration
+	for (std::string vowels = "aeiou"; found < 3; found++) {
+		if (vowels.find(s[found]) == std::string::npos)
+			break;
+	}
+	return found;
+}
+
+unsigned crc(unsigned char c) {
+	// constant expression: constexpr
+	const unsigned table[256] = {0, 0x77073096, 0xee0e612c};
+	return table[c];
+}
+
+std::string greeting() {
+	// returned, constructed in place: no warning
+	std::string hello = "hello";
+	return hello;
+}
+
+struct ScopedTimer {
+	explicit ScopedTimer(const char *name);
+	~ScopedTimer();
+};
+
+void work() {
+	// destroyed at the end of each call on purpose: no warning
+	ScopedTimer timer("work");
+	// default constructed: no warning
+	std::string buffer;
+}
@@ -0,0 +1,30 @@
+// run with -large-copies=256
+
+// 456 bytes
+struct Settings {
+	char name[200];
+	int values[64];
+};
+
+static struct Settings defaults = {"default", {1, 2, 3}};
+
+static int sum(struct Settings settings) {
+	int total = 0;
+	for (int i = 0; i < 64; i++)
+		total += settings.values[i];
+	return total;
+}
+
+int main(void) {
+	int total = 0;
+	for (int i = 0; i < 3; i++)
+		total += sum(defaults);
+	struct Settings local = defaults;
+	return total + local.values[0];
+}
+
+// expected:
+// defaults is copied in a loop (456 bytes), note: take a
+//   'const struct Settings *' parameter instead
+// defaults is copied (456 bytes), note: point to it instead:
+//   'const struct Settings *local = &...'
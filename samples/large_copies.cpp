@@ -0,0 +1,36 @@
+#include <string>
+
+// run with -large-copies=256
+
+// 456 bytes
+struct Settings {
+	char name[200];
+	int values[64];
+};
+
+static Settings defaults = {"default", {1, 2, 3}};
+
+// owns memory, but is smaller than the threshold: not reported
+static std::string greeting = "hello";
+
+static int sum(Settings settings) {
+	int total = 0;
+	for (int value : settings.values)
+		total += value;
+	return total;
+}
+
+int main() {
+	int total = 0;
+	for (int i = 0; i < 3; i++)
+		total += sum(defaults);
+	Settings local = defaults;
+	std::string copy = greeting;
+	return total + local.values[0] + (int)copy.size();
+}
+
+// expected:
+// defaults is copied in a loop (456 bytes), note: take the parameter by
+//   const reference
+// defaults is copied (456 bytes), note: bind a reference instead:
+//   'const auto &local = ...'
@@ -0,0 +1,23 @@
+#include <string>
+#include <vector>
+
+// names only used in the loop body, but moving the vector there would
+// build it on every iteration: the advice points at main's body instead
+std::vector<std::string> names = {"a", "b", "c"};
+
+// cheap to construct, fine to move into the loop body
+int limit = 10;
+
+int main() {
+	int total = 0;
+	for (int i = 0; i < 100; i++) {
+		if (i % 2) {
+			total += names.size();
+			total += limit;
+		}
+	}
+	return total;
+}
+
+// expected (with -warn-init): both only used in a smaller scope, names
+// moved to the body of main, limit to the if block
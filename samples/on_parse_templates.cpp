@@ -0,0 +1,14 @@
+// run with and without -on-parse, the findings are the same
+
+int counter;
+
+template <class T> void bump() { counter++; }
+
+int main() {
+	// instantiated at the end of the TU, a second body using counter
+	// that only -on-parse is handed
+	bump<int>();
+	return 0;
+}
+
+// expected: counter only used in a smaller scope, in bump()
@@ -0,0 +1,18 @@
+// run with -padding
+
+// 24 bytes, 16 when ordered as value, count, kind, flags
+struct Entry {
+	char kind;
+	double value;
+	char flags;
+	int count;
+};
+
+struct Entry entries[100];
+
+int main() {
+	entries[0].count = 1;
+	return entries[0].count;
+}
+
+// expected: entries wastes 1000 bytes on padding, 10 in each element
@@ -0,0 +1,45 @@
+#include <cstdio>
+#include <cstring>
+
+// run with -relocations
+
+// never written: could be a char array
+static const char *greeting = "hello";
+
+// pointed elsewhere by setMode(): still needs a relocation, no note
+static const char *mode = "fast";
+
+// similar lengths: a fixed width table
+static const char *const colors[] = {"red", "green", "blue"};
+
+// one long string: offsets into a single string
+static const char *const messages[] = {"a", "b",
+                                       "the file could not be opened"};
+
+static void onStart(int) { puts("start"); }
+static void onStop(int) { puts("stop"); }
+
+// function pointers: make them const
+static void (*handlers[])(int) = {onStart, onStop};
+
+static void setMode(const char *name) { mode = name; }
+
+int main(int argc, char **argv) {
+	if (argc > 1)
+		setMode(argv[1]);
+	handlers[argc % 2](argc);
+	printf("%s %s %s %s\n", greeting, mode, colors[argc % 3],
+	       messages[argc % 3]);
+	return strcmp(mode, "fast") == 0;
+}
+
+// expected:
+// greeting needs 1 dynamic relocation, note: declare it as an array,
+//   'constexpr char greeting[]'
+// mode needs 1 dynamic relocation, no note
+// colors needs 3 dynamic relocations, note: a fixed width table,
+//   'const char colors[][6]', needs none (18 bytes)
+// messages needs 3 dynamic relocations, note: keep the strings in one
+//   char array and store offsets into it
+// handlers needs 2 dynamic relocations, note: declare the pointers
+//   'const'
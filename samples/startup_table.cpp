@@ -0,0 +1,33 @@
+#include <cstdint>
+
+// run with -constexpr-tables
+
+// filled by crcInit() at startup: could be a constexpr table
+static uint32_t crcTable[256];
+
+static void crcInit() {
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int k = 0; k < 8; k++)
+			c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+		crcTable[i] = c;
+	}
+}
+
+uint32_t crc32(const unsigned char *data, int length) {
+	uint32_t c = 0xFFFFFFFF;
+	for (int i = 0; i < length; i++)
+		c = crcTable[(c ^ data[i]) & 0xFF] ^ (c >> 8);
+	return c ^ 0xFFFFFFFF;
+}
+
+int main() {
+	crcInit();
+	return crc32((const unsigned char *)"abc", 3) == 0x352441C2;
+}
+
+// expected (with -std=c++17 or later):
+// 'crcTable' is filled at startup by 'crcInit', it could be generated at
+//   compile time, note at crcInit: make 'crcInit' a constexpr function
+//   returning the table, e.g. a std::array, and initialize a constexpr
+//   'crcTable' with it; the table moves to read-only data
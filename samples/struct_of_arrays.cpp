@@ -0,0 +1,34 @@
+// run with -soa
+
+struct Particle {
+	double x, y, z;
+	double vx, vy, vz;
+	double mass;
+	int id;
+};
+
+Particle particles[1024];
+
+double totalMass() {
+	// reads 8 of the 64 bytes of each particle
+	double total = 0;
+	for (int i = 0; i < 1024; i++)
+		total += particles[i].mass;
+	return total;
+}
+
+void step(double dt) {
+	// position and velocity, 48 bytes: still more than half
+	for (int i = 0; i < 1024; i++) {
+		particles[i].x += particles[i].vx * dt;
+		particles[i].y += particles[i].vy * dt;
+		particles[i].z += particles[i].vz * dt;
+	}
+}
+
+int main() {
+	step(0.1);
+	return totalMass() > 0;
+}
+
+// expected: particles reported, with a note on the loop of totalMass
@@ -0,0 +1,21 @@
+// run with -volatile-loops
+
+volatile int stop;
+volatile long processed;
+
+void worker(const int *items, int count) {
+	// stop is a polled flag, processed an accumulator
+	for (int i = 0; i < count && !stop; i++) {
+		if (items[i])
+			processed++;
+	}
+}
+
+void requestStop(void) { stop = 1; }
+
+int main(void) {
+	int items[] = {1, 0, 1};
+	worker(items, 3);
+	requestStop();
+	return processed;
+}
@@ -0,0 +1,20 @@
+#!/bin/sh
+# Print the lines changed by `git diff` in the format read by
+# `rcs-batch -changed-files` and `-changed-lines`: one path:first-last
+# per hunk, with absolute paths.
+#
+# usage: scripts/changed-lines.sh [git diff arguments, e.g. origin/main...]
+
+root=$(git rev-parse --show-toplevel) || exit 1
+git diff -U0 --no-color "$@" | awk -v root="$root" '
+/^\+\+\+ / {
+	file = ($2 == "/dev/null") ? "" : root "/" substr($2, 3)
+	next
+}
+/^@@ / && file != "" {
+	split(substr($3, 2), range, ",")
+	count = (2 in range) ? range[2] : 1
+	# pure deletions still mark the file (and the line after) as changed
+	last = (count > 0) ? range[1] + count - 1 : range[1]
+	print file ":" range[1] "-" last
+}'
@@ -0,0 +1,51 @@
+#!/usr/bin/env python3
+# Merge the findings recorded with -sample-log over the last days, for
+# checker runs with -sample-rate=1/N: after N builds every translation
+# unit has been analyzed once, and this prints the union of their latest
+# findings, each finding once.
+#
+# usage: scripts/collect-sampled-findings.py <log dir> [days]
+#
+#   clang $plugin $rcs_opt -sample-rate=1/7 $rcs_opt -sample-log=/var/rcs ...
+#   scripts/collect-sampled-findings.py /var/rcs 7
+
+import os
+import sys
+import time
+
+if len(sys.argv) < 2:
+    sys.exit("usage: %s <log dir> [days]" % sys.argv[0])
+directory = sys.argv[1]
+days = float(sys.argv[2]) if len(sys.argv) > 2 else 7
+oldest = time.time() - days * 86400
+
+covered = 0
+builds = set()
+findings = set()
+for name in os.listdir(directory):
+    if not name.endswith(".log"):
+        continue
+    with open(os.path.join(directory, name), errors="replace") as f:
+        lines = f.read().splitlines()
+    header = {}
+    while lines and lines[0].split(" ", 1)[0] in ("tu", "build", "time"):
+        key, _, value = lines.pop(0).partition(" ")
+        header[key] = value
+    if float(header.get("time", 0)) < oldest:
+        continue
+    covered += 1
+    builds.add(header.get("build"))
+    # a warning together with the notes following it
+    finding = []
+    for line in lines:
+        if ": note: " not in line and finding:
+            findings.add("\n".join(finding))
+            finding = []
+        finding.append(line)
+    if finding:
+        findings.add("\n".join(finding))
+
+for finding in sorted(findings):
+    print(finding)
+sys.stderr.write("%d translation units covered by %d builds in the last %g days\n"
+                 % (covered, len(builds), days))
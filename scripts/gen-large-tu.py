@@ -0,0 +1,37 @@
+#!/usr/bin/env python3
+# Generate a large single translation unit for timing the checker, similar
+# in shape to generated parsers: many globals and many mid-sized functions
+# with nested blocks.
+#
+# usage: scripts/gen-large-tu.py [lines] > large.c
+#
+#   time clang $plugin large.c
+#   time clang $plugin $rcs_opt -jobs=8 large.c
+
+import sys
+
+lines = int(sys.argv[1]) if len(sys.argv) > 1 else 200000
+globals_count = max(1, lines // 100)
+
+out = []
+for g in range(globals_count):
+    out.append("int g%d = %d;" % (g, g))
+
+f = 0
+while len(out) < lines:
+    a, b = (f * 7) % globals_count, (f * 13 + 1) % globals_count
+    out.append("int f%d(int x) {" % f)
+    out.append("\tint acc = x;")
+    for i in range(8):
+        out.append("\tfor (int i = 0; i < %d; i++) {" % (i + 2))
+        out.append("\t\tif (acc %% %d == 0) {" % (i + 3))
+        out.append("\t\t\tacc += g%d * i;" % a)
+        out.append("\t\t} else {")
+        out.append("\t\t\tacc -= g%d;" % b)
+        out.append("\t\t}")
+        out.append("\t}")
+    out.append("\treturn acc;")
+    out.append("}")
+    f += 1
+
+print("\n".join(out))